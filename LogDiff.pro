@@ -13,8 +13,22 @@ TEMPLATE = app
 
 
 SOURCES += main.cpp\
-        logdiff.cpp
+        logdiff.cpp\
+        patiencediff.cpp\
+        matchworker.cpp\
+        matchcache.cpp\
+        matchscheduler.cpp\
+        tracestore.cpp\
+        reportexport.cpp\
+        pmlreader.cpp
 
-HEADERS  += logdiff.h
+HEADERS  += logdiff.h\
+        patiencediff.h\
+        matchworker.h\
+        matchcache.h\
+        matchscheduler.h\
+        tracestore.h\
+        reportexport.h\
+        pmlreader.h
 
 FORMS    += logdiff.ui
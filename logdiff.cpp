@@ -1,11 +1,23 @@
 #include "logdiff.h"
 #include "ui_logdiff.h"
+#include "patiencediff.h"
+#include "matchworker.h"
+#include "pmlreader.h"
+#include "reportexport.h"
 
+#include <QActionGroup>
+#include <QDesktopServices>
 #include <QFileDialog>
+#include <QFileInfo>
+#include <QHeaderView>
+#include <QInputDialog>
 #include <QMessageBox>
 #include <QProcess>
 #include <QProgressDialog>
+#include <QScrollBar>
+#include <QTextDocument>
 #include <QThreadPool>
+#include <QVBoxLayout>
 
 #ifdef _WIN32
 #include <windows.h>
@@ -15,9 +27,44 @@
 
 #define MAX_LINE_LEN 2048
 
+// shards queued per worker process, so that a crashed worker
+// only costs a small part of the comparison space
+#define SHARDS_PER_WORKER 4
+
+// how often growing logs are checked when following them
+#define TAIL_POLL_MS 2000
+
+// matching tasks per thread, rows costing more than their share are split
+#define TASKS_PER_THREAD 8
+
+// pairs at least this long are estimated when estimating is on
+#define APPROX_MIN_ROWS 20000
+
+// candidates of a row in view diffed at a time in lazy matching
+#define LAZY_CANDIDATES 16
+
+// how long the view has to stay put before its rows are confirmed
+#define CONFIRM_DELAY_MS 150
+
+// how often a running diff process is checked for a canceled run
+#define DIFF_POLL_MS 100
+
+// bytes of a log fed to grep at a time when searching what it grew by
+#define GREP_CHUNK_SIZE (1 << 20)
+
 LogDiff::LogDiff(QWidget *parent) :
     QMainWindow(parent),
-    ui(new Ui::LogDiff)
+    ui(new Ui::LogDiff),
+    splitOffset1(0),
+    splitOffset2(0),
+    workerProcs(0),
+    memoryBudgetMB(0),
+    baselineSize(0),
+    baselineMode(false),
+    splitting(false),
+    diffsTotal(0),
+    baselineDialog(NULL),
+    baselineTable(NULL)
 {
     ui->setupUi(this);
 
@@ -41,10 +88,28 @@ LogDiff::LogDiff(QWidget *parent) :
          t->horizontalHeaderItem(i)->setTextAlignment(Qt::AlignLeft);
          t->setColumnWidth(i, widths[i]);
     }
+
+    QActionGroup *keyGroup = new QActionGroup(this);
+    keyGroup->addAction(ui->actionCompareLines);
+    keyGroup->addAction(ui->actionCompareOperations);
+    keyGroup->addAction(ui->actionComparePaths);
+
+    connect(&tailTimer, SIGNAL(timeout()), this, SLOT(pollLogs()));
+    connect(&matchProgress, SIGNAL(canceled()), this, SLOT(cancelMatching()));
+    confirmTimer.setSingleShot(true);
+    confirmTimer.setInterval(CONFIRM_DELAY_MS);
+    connect(&confirmTimer, SIGNAL(timeout()), this, SLOT(confirmVisibleMatches()));
+    connect(t->verticalScrollBar(), SIGNAL(valueChanged(int)), &confirmTimer, SLOT(start()));
+    connect(t, SIGNAL(itemSelectionChanged()), &confirmTimer, SLOT(start()));
+
+    QString dataDir = QDesktopServices::storageLocation(QDesktopServices::DataLocation);
+    matchCache.load(QDir(dataDir).filePath("matchcache.bin"));
 }
 
 LogDiff::~LogDiff()
 {
+    stopMatching();
+    matchCache.save();
     clearSession();
     delete ui;
 }
@@ -106,25 +171,59 @@ int gettimeofday(struct timeval *tv)
 
 #endif // _WIN32
 
+void LogDiff::clearCandidates()
+{
+    if (sessionDir.isEmpty())
+        return;
+
+    foreach (QString id, ids2) {
+        QDir(sessionDir).remove(QString("1-%1.csv").arg(id));
+        QDir(sessionDir).remove(QString("1-%1.match").arg(id));
+        QDir(sessionDir).remove(QString("1-%1.run").arg(id));
+    }
+    for (int i=0; i<candidates.size(); i++) {
+        foreach (QString id, candidates.at(i).ids) {
+            QDir(sessionDir).remove(QString("%1-%2.csv").arg(i+1).arg(id));
+            QDir(sessionDir).remove(QString("%1-%2.match").arg(i+1).arg(id));
+            QDir(sessionDir).remove(QString("%1-%2.run").arg(i+1).arg(id));
+        }
+        store.clearLog(i+1);
+    }
+    store.clearLog(1);
+
+    ids2.clear();
+    lineNums2.clear();
+    seqHashes2.clear();
+    candidates.clear();
+    searchHits[1] = SearchHits();
+
+    bestMatches.clear();
+    otherMatches.clear();
+
+    clearMatchRows();
+
+    if (baselineDialog)
+        baselineDialog->hide();
+}
+
 void LogDiff::clearSession()
 {
     if (sessionDir.isEmpty())
         return;
 
+    clearCandidates();
+
     foreach (QString id, ids1) {
         QDir(sessionDir).remove(QString("0-%1.csv").arg(id));
         QDir(sessionDir).remove(QString("0-%1.match").arg(id));
+        QDir(sessionDir).remove(QString("0-%1.run").arg(id));
     }
-    foreach (QString id, ids2) {
-        QDir(sessionDir).remove(QString("1-%1.csv").arg(id));
-        QDir(sessionDir).remove(QString("1-%1.match").arg(id));
-    }
+    searchHits[0] = SearchHits();
 
     QDir().rmpath(sessionDir);
 
     sessionDir.clear();
-
-    ui->threadsTable->setRowCount(0);
+    baselineFname.clear();
 }
 
 bool LogDiff::initSession()
@@ -142,6 +241,15 @@ bool LogDiff::initSession()
     ids1.clear();
     ids2.clear();
 
+    lineNums1.clear();
+    lineNums2.clear();
+
+    store.clear();
+    store.setBudget((qint64)memoryBudgetMB << 20, sessionDir);
+
+    seqHashes1.clear();
+    seqHashes2.clear();
+
     pidCol = -1;
     tidCol = -1;
     operCol = -1;
@@ -158,21 +266,60 @@ void removeBom(QByteArray &line)
         line.remove(0, endOfBom);
 }
 
-bool LogDiff::splitThreads(int logNo, QStringList &ids, QHash<QString, int> &lineNums, bool &slow)
+bool LogDiff::splitThreads(int logNo, const QString &logFname, QStringList &ids, QHash<QString, int> &lineNums,
+        QHash<QString, QByteArray> &seqHashes, bool &slow, qint64 &endOffset, QSet<QString> *changed)
+{
+    // the logs can't be followed while they are being split, a poll
+    // from the event loop would split them again from where this one is
+    splitting = true;
+    bool ret = splitLog(logNo, logFname, ids, lineNums, seqHashes, slow, endOffset, changed);
+    splitting = false;
+
+    return ret;
+}
+
+bool LogDiff::splitLog(int logNo, const QString &logFname, QStringList &ids, QHash<QString, int> &lineNums,
+        QHash<QString, QByteArray> &seqHashes, bool &slow, qint64 &endOffset, QSet<QString> *changed)
 {
-    QString logFname = logNo ? ui->log2Edit->text() : ui->log1Edit->text();
+    // PML captures are split straight from their events
+    QSharedPointer<PmlReader> pml;
     QFile logFile(logFname);
-    if (!logFile.open(QFile::ReadOnly)) {
+
+    if (PmlReader::isPml(logFname)) {
+        // a saved capture doesn't grow, there is nothing to follow
+        if (endOffset > 0)
+            return true;
+
+        pml = QSharedPointer<PmlReader>(new PmlReader(logFname));
+
+        QString err;
+        if (!pml->open(err)) {
+            error("Load error", err);
+            return false;
+        }
+    } else if (!logFile.open(QFile::ReadOnly)) {
         error("Load error", QString("Error opening %1").arg(logFname));
         return false;
     }
 
-    QHash<QString, QFile*> threadFiles;
+    // the reader leaves out what a CSV export has in the Detail column and
+    // the sub-operations, so a capture only compares with another capture
+    if (logNo > 0 && !pml.isNull() != store.isPml(0)) {
+        error("Load error", QString(
+            "%1 is a %2, but log #1 is a %3.\n"
+            "\n"
+            "Compare two PML captures, or two CSV exports of them.")
+            .arg(logFname)
+            .arg(pml.isNull() ? "CSV export" : "PML capture")
+            .arg(pml.isNull() ? "PML capture" : "CSV export"));
+        return false;
+    }
+
     QHash<QString, QFile*> matchFiles;
 
     bool ret = true;
 
-    QRegExp numbers("0x[0-9a-f]+|[0-9][0-9]+|[0-9a-z]+-[0-9a-z]+-[0-9a-z]+-[0-9a-z]+-[0-9a-z]+|[0-9]+:[0-9]+:[0-9]+| PM| AM", Qt::CaseInsensitive);
+    QRegExp numbers(NUMBERS_PATTERN, Qt::CaseInsensitive);
 
     QProgressDialog progress;
     progress.setLabelText(QString("Splitting log file #%1 ...").arg(logNo+1));
@@ -188,11 +335,41 @@ bool LogDiff::splitThreads(int logNo, QStringList &ids, QHash<QString, int> &lin
 
     bool firstLine = true;
 
+    if (endOffset > 0) {
+        // picking up a growing log where we left it. the header was
+        // checked the first time around, we just need the field count.
+        fieldsNum = logFile.readLine(MAX_LINE_LEN).count(',') + 1;
+        logFile.seek(endOffset);
+        firstLine = false;
+    }
+
+    int event = 0;
+
     for (int counter=0; ; counter++) {
         if (counter % 2000 == 0)
             QApplication::processEvents();
 
-        QByteArray line = logFile.readLine(MAX_LINE_LEN);
+        qint64 offset;
+        QByteArray line;
+
+        if (!pml.isNull()) {
+            // events go by their number, as the store reads them back
+            offset = event;
+            if (firstLine) {
+                line = pml->header();
+            } else {
+                while (event < pml->eventCount() && !pml->eventLine(event, line))
+                    event++;
+                if (event == pml->eventCount())
+                    line.clear();
+                offset = event++;
+            }
+        } else {
+            offset = logFile.pos();
+            endOffset = offset;
+            line = logFile.readLine(MAX_LINE_LEN);
+        }
+
         if (line.isEmpty()) {
             if (firstLine) {
                 error("Load error", QString("Empty or unsupported file: ").arg(logFname));
@@ -209,6 +386,10 @@ bool LogDiff::splitThreads(int logNo, QStringList &ids, QHash<QString, int> &lin
                 break;
             }
 
+            // the last line is still being written. leave it for next time
+            if (logFile.atEnd())
+                break;
+
             // we just read an incomplete line. read on till EOL and throw it away
             do {
                 line = logFile.readLine(MAX_LINE_LEN);
@@ -253,6 +434,7 @@ bool LogDiff::splitThreads(int logNo, QStringList &ids, QHash<QString, int> &lin
                 break;
             }
 
+            store.beginLog(logNo, logFname, line, pml);
             continue;
         }
 
@@ -273,51 +455,66 @@ bool LogDiff::splitThreads(int logNo, QStringList &ids, QHash<QString, int> &lin
 
         QString id = QString("%1-%2").arg(pid).arg(tid);
 
-        QFile *threadFile=NULL;
         QFile *matchFile=NULL;
 
-        if (threadFiles.contains(id)) {
-            threadFile = threadFiles[id];
+        if (matchFiles.contains(id)) {
             matchFile = matchFiles[id];
         } else {
-            QString threadFname = QDir(sessionDir).filePath(QString("%1-%2.csv").arg(logNo).arg(id));
-            QString matchFname  = QDir(sessionDir).filePath(QString("%1-%2.match").arg(logNo).arg(id));
+            // the raw lines stay in the log, see TraceStore
+            QString matchFname = QDir(sessionDir).filePath(QString("%1-%2.match").arg(logNo).arg(id));
 
-            threadFile = new QFile(threadFname);
-            matchFile  = new QFile(matchFname);
+            bool known = lineNums.contains(id);
 
-            bool ret1 = threadFile->open(QFile::WriteOnly);
-            bool ret2 = ret1 && matchFile->open(QFile::WriteOnly);
+            matchFile = new QFile(matchFname);
 
-            if (! (ret1 && ret2)) {
-                threadFile->close();
-                matchFile->close();
-                delete threadFile;
+            if (!matchFile->open(known ? QFile::Append : QFile::WriteOnly)) {
                 delete matchFile;
-                error("Split error", QString("Error creating %1").arg(ret1 ? matchFname : threadFname));
+                error("Split error", QString("Error creating %1").arg(matchFname));
                 ret = false;
                 break;
             }
 
-            ids.append(id);
-            threadFiles[id] = threadFile;
             matchFiles[id] = matchFile;
-            lineNums[id] = 0;
+
+            if (!known) {
+                ids.append(id);
+                lineNums[id] = 0;
+            }
         }
 
         QString matchLine = line;
         matchLine.replace(numbers, "x");
 
-        threadFile->write(line);
-        matchFile->write(matchLine.toAscii().data());
+        QByteArray matchData = matchLine.toAscii();
+
+        matchFile->write(matchData);
+
+        if (!store.addEvent(logNo, id, offset, fields, hashLine(matchData.constData(), matchData.size()))) {
+            error("Split error", QString("Error writing run files to %1").arg(sessionDir));
+            ret = false;
+            break;
+        }
 
         lineNums[id]++;
     }        
 
-    foreach (QFile *file, threadFiles)
-        delete file;
-    foreach (QFile *file, matchFiles)
-        delete file;
+    if (ret && !store.flush()) {
+        error("Split error", QString("Error writing run files to %1").arg(sessionDir));
+        ret = false;
+    }
+
+    // the threads we wrote to are the ones that changed
+    QHash<QString, QFile*>::const_iterator it;
+    for (it = matchFiles.constBegin(); it != matchFiles.constEnd(); ++it) {
+        seqHashes[it.key()] = store.seqHash(logNo, it.key());
+        if (changed)
+            changed->insert(it.key());
+
+        delete it.value();
+    }
+
+    if (!pml.isNull())
+        endOffset = QFileInfo(logFname).size();
 
     slow |= progress.isVisible();
     return ret;
@@ -325,14 +522,395 @@ bool LogDiff::splitThreads(int logNo, QStringList &ids, QHash<QString, int> &lin
 
 void DiffTask::postError(const QString &error)
 {
-    QApplication::postEvent(parent, new ThreadErrorEvent(error));
+    QApplication::postEvent(parent, new ThreadErrorEvent(error, generation));
 }
 
-void DiffTask::run()
+bool DiffTask::canceled() const
+{
+    return scheduler && !scheduler->isCurrent(generation);
+}
+
+bool DiffTask::loadSequence(const QString &fname, QVector<quint64> &seq)
+{
+    QFile f(QDir(sessionDir).filePath(fname));
+    if (!f.open(QFile::ReadOnly))
+        return false;
+
+    for (;;) {
+        char line[MAX_LINE_LEN];
+        qint64 len = f.readLine(line, sizeof(line));
+        if (len <= 0) break;
+
+        seq.append(hashLine(line, len));
+    }
+
+    return true;
+}
+
+bool DiffTask::windowRows(int logNo, const QString &id, int &from, int &to, QString &error)
+{
+    if (!store->windowRows(logNo, id, logNo == 0 ? window1 : window2, from, to)) {
+        error = QString("Could not read the times of %1-%2").arg(logNo).arg(id);
+        return false;
+    }
+
+    return true;
+}
+
+bool DiffTask::sequence(int logNo, const QString &id, QVector<quint64> &seq, QString &error, int from, int to)
+{
+    // the trace store is only there in the gui process, workers go by the .match files
+    if (store) {
+        // rows are counted from the start of the time window
+        int first, last;
+        if (!windowRows(logNo, id, first, last, error))
+            return false;
+
+        from += first;
+        to = to < 0 ? last : qMin(first + to, last);
+
+        if (!store->sequence(logNo, id, seqKey, seq, from, to)) {
+            error = QString("Could not read the run file of %1-%2").arg(logNo).arg(id);
+            return false;
+        }
+        return true;
+    }
+
+    QString fname = QString("%1-%2.match").arg(logNo).arg(id);
+    if (!loadSequence(fname, seq)) {
+        error = QString("Could not read %1").arg(fname);
+        return false;
+    }
+
+    return true;
+}
+
+bool DiffTask::compareBudgeted(MemoryBudget *budget, const QString &id2, Match &match, QString &error)
+{
+    int from1, to1, from2, to2;
+    if (!windowRows(0, id1, from1, to1, error) || !windowRows(logNo2, id2, from2, to2, error))
+        return false;
+
+    int rows1 = to1 - from1;
+    int rows2 = to2 - from2;
+
+    qint64 cost = (qint64)(rows1 + rows2) * SEQ_BYTES_PER_ROW;
+    qint64 reserved = budget->acquire(cost);
+
+    // a pair that doesn't fit in the budget is compared a slice at a
+    // time, lining the slices up by their position in each thread; a pair
+    // of empty threads is still compared once, and matches exactly
+    int slices = (int)qMax(Q_INT64_C(1), (cost + reserved - 1) / reserved);
+
+    int removals = 0;
+    int additions = 0;
+
+    bool ok = true;
+    for (int i=0; ok && i<slices; i++) {
+        QVector<quint64> seq1;
+        QVector<quint64> seq2;
+
+        int sliceRemovals, sliceAdditions;
+        ok = sequence(0, id1, seq1, error, (qint64)rows1*i/slices, (qint64)rows1*(i+1)/slices) &&
+             sequence(logNo2, id2, seq2, error, (qint64)rows2*i/slices, (qint64)rows2*(i+1)/slices) &&
+             patienceDiff(seq1, seq2, sliceRemovals, sliceAdditions, this);
+
+        if (ok) {
+            removals += sliceRemovals;
+            additions += sliceAdditions;
+        }
+    }
+
+    budget->release(reserved);
+    if (!ok)
+        return false;
+
+    match = Match(removals, additions, id1, id2);
+    if (slices == 1)
+        return true;
+
+    // lines kept in line-up slices are kept in the whole threads too, but
+    // lines moved across a slice boundary are lost, so this is only an upper
+    // bound on the removals. the lower one is the k-mer estimate's
+    match.approx = true;
+    match.sliced = true;
+    match.removalsLow = qMax(0, rows1 - rows2);
+
+    QVector<quint64> sample1;
+    QVector<quint64> sample2;
+    if (!threadSample(0, id1, sample1, error) || !threadSample(logNo2, id2, sample2, error))
+        return false;
+
+    int common, low, high;
+    if (estimateCommon(sample1, rows1, sample2, rows2, common, low, high))
+        match.removalsLow = qMax(match.removalsLow, rows1 - high);
+    match.removalsLow = qMin(match.removalsLow, removals);
+
+    return true;
+}
+
+static Match estimatedMatch(const QString &id1, const QString &id2, int rows1, int rows2,
+        int common, int low, int high)
+{
+    Match match(rows1 - common, rows2 - common, id1, id2);
+    match.approx = true;
+    match.removalsLow = rows1 - high;
+    match.removalsHigh = rows1 - low;
+    return match;
+}
+
+void ThreadSamples::clear()
+{
+    QMutexLocker locker(&mutex);
+    samples.clear();
+}
+
+bool ThreadSamples::find(const QString &key, QVector<quint64> &sample)
+{
+    QMutexLocker locker(&mutex);
+
+    while (taking.contains(key))
+        taken.wait(&mutex);
+
+    QHash<QString, QVector<quint64> >::const_iterator it = samples.constFind(key);
+    if (it == samples.constEnd()) {
+        taking.insert(key);
+        return false;
+    }
+
+    sample = it.value();
+    return true;
+}
+
+void ThreadSamples::insert(const QString &key, const QVector<quint64> &sample)
+{
+    QMutexLocker locker(&mutex);
+    samples[key] = sample;
+    taking.remove(key);
+    taken.wakeAll();
+}
+
+void ThreadSamples::abandon(const QString &key)
+{
+    QMutexLocker locker(&mutex);
+    taking.remove(key);
+    taken.wakeAll();
+}
+
+bool ThreadSamples::sample(const TraceStore *store, TraceStore::SeqKey seqKey, int logNo, const QString &id,
+        const TimeWindow &window, int rate, const DiffCancel *cancel, QVector<quint64> &sample, QString &error)
+{
+    // each thread is sampled once per session and rate, by the first task to need it
+    QString key = QString("%1-%2-%3").arg(logNo).arg(id).arg(rate);
+    if (find(key, sample))
+        return true;
+
+    bool ok = sampleThread(store, seqKey, logNo, id, window, rate, cancel, sample, error) &&
+            !cancel->isCanceled();
+
+    if (ok)
+        insert(key, sample);
+    else
+        abandon(key);
+
+    return ok;
+}
+
+bool ThreadSamples::sampleThread(const TraceStore *store, TraceStore::SeqKey seqKey, int logNo, const QString &id,
+        const TimeWindow &window, int rate, const DiffCancel *cancel, QVector<quint64> &sample, QString &error)
+{
+    int first, last;
+    if (!store->windowRows(logNo, id, window, first, last)) {
+        error = QString("Could not read the times of %1-%2").arg(logNo).arg(id);
+        return false;
+    }
+    int rows = last - first;
+
+    // within a budget the thread is sampled a slice at a time
+    MemoryBudget *budget = store->memoryBudget();
+    int sliceRows = qMax(1, rows);
+    qint64 reserved = 0;
+    if (budget) {
+        reserved = budget->acquire((qint64)rows * SEQ_BYTES_PER_ROW);
+        sliceRows = (int)qMax(Q_INT64_C(1), reserved / SEQ_BYTES_PER_ROW);
+    }
+
+    sample.clear();
+
+    bool ok = true;
+    for (int from=first; ok && from<last && !cancel->isCanceled(); from+=sliceRows) {
+        QVector<quint64> seq;
+        QVector<quint64> sliceSample;
+
+        // the k-mers across the start of the slice are sampled with it
+        ok = store->sequence(logNo, id, seqKey, seq, qMax(first, from - (KMER_LEN-1)), qMin(from + sliceRows, last));
+        if (!ok) {
+            error = QString("Could not read the run file of %1-%2").arg(logNo).arg(id);
+            break;
+        }
+
+        sampleKmers(seq, sliceSample, rate);
+        sample += sliceSample;
+    }
+
+    if (budget)
+        budget->release(reserved);
+
+    qSort(sample);
+    return ok;
+}
+
+bool DiffTask::threadSample(int logNo, const QString &id, QVector<quint64> &sample, QString &error)
+{
+    return samples->sample(store, seqKey, logNo, id, logNo == 0 ? window1 : window2, KMER_RATE, this,
+            sample, error);
+}
+
+bool DiffTask::estimatePair(const QString &id2, QVector<quint64> &sample1, int &rows1,
+        QList<Match> &matches, bool &done, QString &error)
+{
+    done = false;
+
+    // the log-1 thread is sampled once per task, when a pair first needs it
+    int from, to;
+    if (rows1 < 0) {
+        if (!windowRows(0, id1, from, to, error))
+            return false;
+        rows1 = to - from;
+    }
+
+    if (!windowRows(logNo2, id2, from, to, error))
+        return false;
+    int rows2 = to - from;
+
+    if (rows1 + rows2 < approxRows)
+        return true;
+
+    if (sample1.isEmpty() && !threadSample(0, id1, sample1, error))
+        return false;
+
+    QVector<quint64> sample2;
+    if (!threadSample(logNo2, id2, sample2, error))
+        return false;
+
+    int common, low, high;
+    if (!estimateCommon(sample1, rows1, sample2, rows2, common, low, high))
+        return true; // too few samples, it gets diffed
+
+    matches.append(estimatedMatch(id1, id2, rows1, rows2, common, low, high));
+
+    done = true;
+    return true;
+}
+
+void EstimateTask::run()
+{
+    QList<Match> *matches = new QList<Match>();
+    QString error;
+
+    if (isCanceled() || !estimate(*matches, error)) {
+        if (!isCanceled())
+            QApplication::postEvent(parent, new ThreadErrorEvent(error, generation));
+        delete matches;
+        return;
+    }
+
+    QApplication::postEvent(parent, new ThreadMatchEvent(matches, logNo2, generation));
+    // the gui thread will delete matches
+}
+
+bool EstimateTask::isCanceled() const
+{
+    return !scheduler->isCurrent(generation);
+}
+
+bool EstimateTask::estimate(QList<Match> &matches, QString &error)
+{
+    // a signature per thread, shared by the tasks of the session, then
+    // every pair is estimated from those
+    ThreadSignature sig1;
+    if (!signThread(0, id1, window1, sig1, error))
+        return false;
+
+    foreach (QString id2, ids2) {
+        ThreadSignature sig2;
+        if (isCanceled() || !signThread(logNo2, id2, window2, sig2, error))
+            return false;
+
+        int common, low, high;
+        estimateSimilar(sig1, sig2, common, low, high);
+        matches.append(estimatedMatch(id1, id2, sig1.rows, sig2.rows, common, low, high));
+    }
+
+    return true;
+}
+
+bool EstimateTask::signThread(int logNo, const QString &id, const TimeWindow &window, ThreadSignature &sig,
+        QString &error)
+{
+    int from, to;
+    if (!store->windowRows(logNo, id, window, from, to)) {
+        error = QString("Could not read the times of %1-%2").arg(logNo).arg(id);
+        return false;
+    }
+
+    sig.rows = to - from;
+    sig.rate = signatureRate(sig.rows);
+    return samples->sample(store, seqKey, logNo, id, window, sig.rate, this, sig.sample, error);
+}
+
+bool DiffTask::comparePatience(QList<Match> &matches, QString &error)
+{
+    // with an external store, sequences are only loaded within the memory budget
+    MemoryBudget *budget = store ? store->memoryBudget() : NULL;
+
+    QVector<quint64> seq1;
+    if (!budget && !sequence(0, id1, seq1, error))
+        return false;
+
+    QVector<quint64> sample1;
+    int rows1 = -1;
+
+    foreach (QString id2, ids2) {
+        if (canceled())
+            return false;
+
+        // long pairs are only estimated, if asked to
+        if (approxRows > 0 && store) {
+            bool done;
+            if (!estimatePair(id2, sample1, rows1, matches, done, error))
+                return false;
+            if (done)
+                continue;
+        }
+
+        if (budget) {
+            Match match;
+            if (!compareBudgeted(budget, id2, match, error))
+                return false;
+            matches.append(match);
+            continue;
+        }
+
+        QVector<quint64> seq2;
+        if (!sequence(logNo2, id2, seq2, error))
+            return false;
+
+        int removals, additions;
+        if (!patienceDiff(seq1, seq2, removals, additions, this))
+            return false;
+
+        matches.append(Match(removals, additions, id1, id2));
+    }
+
+    return true;
+}
+
+bool DiffTask::compareGnuDiff(QList<Match> &matches, QString &error)
 {
     QStringList fnameList2;
     foreach (QString id2, ids2)
-        fnameList2.append(QString("1-%1.match").arg(id2)); // we start diff in sessionDir
+        fnameList2.append(QString("%1-%2.match").arg(logNo2).arg(id2)); // we start diff in sessionDir
 
     QString fname1 = QString("0-%1.match").arg(id1); // we start diff in sessionDir
 
@@ -347,16 +925,26 @@ void DiffTask::run()
     diffProc.setWorkingDirectory(sessionDir);
     diffProc.start("diff", args);
 
-    if (!diffProc.waitForFinished() || diffProc.exitCode() >= 2) {
-        postError(QString("Could not compare %1 to log #2").arg(fname1));
-        return;
+    // a canceled run doesn't wait for diff to finish
+    while (!diffProc.waitForFinished(DIFF_POLL_MS) && diffProc.state() != QProcess::NotRunning) {
+        if (canceled()) {
+            diffProc.kill();
+            diffProc.waitForFinished();
+            return false;
+        }
+    }
+
+    if (diffProc.error() == QProcess::FailedToStart || diffProc.exitStatus() != QProcess::NormalExit ||
+        diffProc.exitCode() >= 2) {
+        error = QString("Could not compare %1 to log #%2").arg(fname1).arg(logNo2+1);
+        return false;
     }
 
     int i2=0;
 
-    QString hdr1 = diffProc.readLine(MAX_LINE_LEN);
+    QString prefix2 = QString("+++ %1-").arg(logNo2);
 
-    QList<Match> *matches = new QList<Match>();
+    QString hdr1 = diffProc.readLine(MAX_LINE_LEN);
 
     for (;;) {
         // hdr1 is also left for us by at the end of this loop below
@@ -364,44 +952,39 @@ void DiffTask::run()
         QString hdr2 = diffProc.readLine(MAX_LINE_LEN);
 
         if (hdr1.isEmpty() ^ hdr2.isEmpty()) {
-            postError(QString("Incomplete diff output for %1").arg(fname1));
-            delete matches;
-            return;
+            error = QString("Incomplete diff output for %1").arg(fname1);
+            return false;
         }
 
         if (hdr1.isEmpty())
             break;
 
-        if (!hdr1.startsWith("--- 0-") || !hdr2.startsWith("+++ 1-")) {
-            postError(QString("Expecting ---/+++ and prefixes in diff output for %1").arg(fname1));
-            delete matches;
-            return;
+        if (!hdr1.startsWith("--- 0-") || !hdr2.startsWith(prefix2)) {
+            error = QString("Expecting ---/+++ and prefixes in diff output for %1").arg(fname1);
+            return false;
         }
 
         int sp1 = hdr1.indexOf('\t', 6);
-        int sp2 = hdr2.indexOf('\t', 6);
+        int sp2 = hdr2.indexOf('\t', prefix2.size());
         if (sp1 < 0 || sp2 < 0) {
-            postError(QString("Could not get name from diff output for %1").arg(fname1));
-            delete matches;
-            return;
+            error = QString("Could not get name from diff output for %1").arg(fname1);
+            return false;
         }
 
         QString name1 = hdr1.mid(6, sp1-6);
-        QString name2 = hdr2.mid(6, sp2-6);
+        QString name2 = hdr2.mid(prefix2.size(), sp2-prefix2.size());
 
         if (!name1.endsWith(".match") || !name2.endsWith(".match")) {
-            postError(QString("Unexpected names from diff output: %1 and %2").arg(name1).arg(name2));
-            delete matches;
-            return;
+            error = QString("Unexpected names from diff output: %1 and %2").arg(name1).arg(name2);
+            return false;
         }
 
         name1.truncate(name1.size()-6);
         name2.truncate(name2.size()-6);
 
         if (name1 != id1) {
-            postError(QString("Unexpected 'from' file in diff output for %1: %2").arg(fname1).arg(name1));
-            delete matches;
-            return;
+            error = QString("Unexpected 'from' file in diff output for %1: %2").arg(fname1).arg(name1);
+            return false;
         }
 
         QString id2;
@@ -411,14 +994,13 @@ void DiffTask::run()
             id2 = ids2.at(i2);
             if (id2 == name2) break;
 
-            matches->append(Match(0, 0, id1, id2));
+            matches.append(Match(0, 0, id1, id2));
             i2++;
         }
 
         if (i2 == ids2.size()) {
-            postError(QString("Unexpected 'to' file in diff output for %1: %2").arg(fname1).arg(name2));
-            delete matches;
-            return;
+            error = QString("Unexpected 'to' file in diff output for %1: %2").arg(fname1).arg(name2);
+            return false;
         }
 
         // done with the header, now count the removed lines
@@ -442,7 +1024,7 @@ void DiffTask::run()
                 additions++;
         }
 
-        matches->append(Match(removals, additions,
+        matches.append(Match(removals, additions,
                 id1, id2));
 
         i2++;
@@ -451,30 +1033,91 @@ void DiffTask::run()
     // end of diff output, so the rest of the files are identical
     while (i2 < ids2.size()) {
         QString id2 = ids2.at(i2);
-        matches->append(Match(0, 0, id1, id2));
+        matches.append(Match(0, 0, id1, id2));
         i2++;
     }
 
-    QApplication::postEvent(parent, new ThreadMatchEvent(matches));
-    // the gui thread will delete matches
+    return true;
 }
 
-void LogDiff::customEvent(QEvent *event)
+bool DiffTask::compare(QList<Match> &matches, QString &error)
 {
-    switch (event->type()) {
-        case ThreadMatchEventType:
-        {
-            ThreadMatchEvent *mevent = (ThreadMatchEvent *)event;
+    if (mode == PatienceDiffMode)
+        return comparePatience(matches, error);
 
-            matches.append(*mevent->matches);
-            delete mevent->matches;
+    return compareGnuDiff(matches, error);
+}
+
+void DiffTask::run()
+{
+    QList<Match> *matches = new QList<Match>();
+    QString error;
+
+    if (canceled() || !compare(*matches, error)) {
+        if (!canceled())
+            postError(error);
+        delete matches;
+        return;
+    }
+
+    QApplication::postEvent(parent, new ThreadMatchEvent(matches, logNo2, generation));
+    // the gui thread will delete matches
+}
+
+void LogDiff::customEvent(QEvent *event)
+{
+    switch (event->type()) {
+        case ThreadMatchEventType:
+        {
+            ThreadMatchEvent *mevent = (ThreadMatchEvent *)event;
+
+            if (!scheduler.isCurrent(mevent->generation)) {
+                delete mevent->matches;
+                break;
+            }
+
+            if (baselineMode) {
+                addCandidateMatches(mevent->logNo2, *mevent->matches);
+                delete mevent->matches;
+                break;
+            }
+
+            diffsDone += mevent->matches->size();
+
+            foreach (Match match, *mevent->matches) {
+                // estimates and sliced diffs are not cached, they depend on
+                // the sampling and the memory budget
+                if (!match.approx)
+                    matchCache.insert(cacheHash(0, match.id1, seqHashes1[match.id1]),
+                            cacheHash(1, match.id2, seqHashes2[match.id2]), cacheVariant,
+                            match.removals, match.additions);
+
+                // a confirmed pair takes the place of its estimate
+                QString pair = match.id1 + " " + match.id2;
+                if (confirming.remove(pair) && estimates.contains(pair)) {
+                    matches[estimates.take(pair)] = match;
+                    confirmed.append(match);
+                    continue;
+                }
+
+                matches.append(match);
+            }
+
+            delete mevent->matches;
 
             if (diffsFailed)
                 break;
 
-            matchProgress.setValue(++diffsDone);
-            if (diffsDone == ids1.size())
-                selectMatches();
+            matchProgress.setValue(diffsDone);
+            if (diffsDone == diffsTotal) {
+                matchCache.save();
+
+                // lazy rounds only change the rows of the pairs they confirmed
+                if (ui->actionLazyMatching->isChecked() && !confirmed.isEmpty())
+                    updateConfirmed();
+                else
+                    selectMatches();
+            }
 
             break;
         }
@@ -482,6 +1125,9 @@ void LogDiff::customEvent(QEvent *event)
         case ThreadErrorEventType:
         {
             ThreadErrorEvent *eevent = (ThreadErrorEvent *)event;
+            if (!scheduler.isCurrent(eevent->generation))
+                break;
+
             error("Diff error", eevent->error);
             diffsFailed = true;
             break;
@@ -500,35 +1146,89 @@ void LogDiff::selectMatches()
         return;
     }
 
+    // the best match of each thread of either log, in one pass. the pairs
+    // of each log-1 thread and the estimates are indexed on the way, for
+    // the confirm rounds to come
+
+    QHash<QString, Match> best1;
+    QHash<QString, Match> best2;
+
+    threadMatches.clear();
+    estimates.clear();
+    confirmed.clear();
+
+    for (int i=0; i<matches.size(); i++) {
+        const Match &match = matches.at(i);
+
+        threadMatches[match.id1].append(i);
+        if (match.confirmable())
+            estimates.insert(match.id1 + " " + match.id2, i);
+
+        Match &b1 = best1[match.id1];
+        if (b1.removals < 0 || match.removals < b1.removals)
+            b1 = match;
+
+        Match &b2 = best2[match.id2];
+        if (b2.removals < 0 || match.additions < b2.additions)
+            b2 = match;
+    }
+
+    // estimates can't tell apart candidates whose bounds overlap the best
+    // one's, those are diffed before the best is taken as such. lazy
+    // matching leaves that to the rows the user looks at
+    if (!ui->actionLazyMatching->isChecked()) {
+        QList<Match> ambiguous;
+        QSet<QString> closeIds1;
+
+        foreach (const Match &match, matches) {
+            const Match &best = best1[match.id1];
+            if (match.id2 == best.id2 || match.removalsLow > best.removalsHigh)
+                continue;
+
+            if (match.confirmable())
+                ambiguous.append(match);
+            closeIds1.insert(match.id1);
+        }
+
+        foreach (QString id1, closeIds1)
+            if (best1[id1].confirmable())
+                ambiguous.append(best1[id1]);
+
+        if (!ambiguous.isEmpty()) {
+            confirmMatches(ambiguous);
+            return;
+        }
+    }
+
     QHash<QString,QString> matchSet;
 
     bestMatches.clear();
     otherMatches.clear();
 
     foreach (QString id1, ids1) {
-        Match best;
-        foreach (Match match, matches)
-            if (match.id1 == id1)
-                if (best.removals < 0 || lineNums1[best.id1]-best.removals < lineNums1[match.id1]-match.removals)
-                    best = match;
-
+        const Match &best = best1[id1];
         matchSet[id1] = best.id2;
-        bestMatches.append(best);
+
+        // threads with no events in the time window are left out
+        if (windowNums1[id1] > 0)
+            bestMatches.append(best);
     }
 
     foreach (QString id2, ids2) {
-        Match best;
-        foreach (Match match, matches)
-            if (match.id2 == id2)
-                if (best.removals < 0 || lineNums2[best.id2]-best.additions < lineNums2[match.id2]-match.additions)
-                    best = match;
+        if (windowNums2[id2] == 0)
+            continue;
 
+        const Match &best = best2[id2];
         if (matchSet[best.id1] != best.id2)
             otherMatches.append(best);
     }
 
-    QHash<quint64, QString> empty;
-    addMatches(bestMatches, otherMatches, empty, empty);
+    // keep the view where it was when the table is refreshed
+    int scroll = ui->threadsTable->verticalScrollBar()->value();
+
+    on_searchBtn_clicked();
+
+    ui->threadsTable->verticalScrollBar()->setValue(scroll);
 }
 
 quint64 stridToIntid(const QString &id)
@@ -545,15 +1245,16 @@ quint64 stridToIntid(const QString &id)
 
 void LogDiff::addMatches(const QList<Match> &best, const QList<Match> &other, const QHash<quint64, QString> firstLines1, const QHash<quint64, QString> firstLines2)
 {
-    ui->threadsTable->setRowCount(0);
+    clearMatchRows();
 
     foreach (Match match, best) {
         QString fline1 = firstLines1[stridToIntid(match.id1)];
         QString fline2 = firstLines2[stridToIntid(match.id2)];
         QString fline = !fline1.isEmpty() ? fline1 : (!fline2.isEmpty() ? fline2 : QString());
 
+        bestRows[match.id1] = ui->threadsTable->rowCount();
         if (!addMatch(match, fline)) {
-            ui->threadsTable->setRowCount(0);
+            clearMatchRows();
             return;
         }
     }
@@ -570,23 +1271,179 @@ void LogDiff::addMatches(const QList<Match> &best, const QList<Match> &other, co
         QString fline2 = firstLines2[stridToIntid(match.id2)];
         QString fline = !fline1.isEmpty() ? fline1 : (!fline2.isEmpty() ? fline2 : QString());
 
+        otherRows[match.id1 + " " + match.id2] = ui->threadsTable->rowCount();
         if (!addMatch(match, fline)) {
-            ui->threadsTable->setRowCount(0);
+            clearMatchRows();
             return;
         }
     }
+
+    confirmVisibleMatches();
 }
 
-void LogDiff::matchThreads(bool &slow)
+void LogDiff::confirmMatches(const QList<Match> &pairs)
+{
+    // one row per log-1 thread, as for the first round
+    QList<MatchRow> rows;
+    QHash<QString, int> rowOf;
+    int count = 0;
+
+    foreach (const Match &pair, pairs) {
+        QString key = pair.id1 + " " + pair.id2;
+        if (confirming.contains(key))
+            continue;
+        confirming.insert(key);
+
+        if (!rowOf.contains(pair.id1)) {
+            rowOf[pair.id1] = rows.size();
+            rows.append(MatchRow(pair.id1));
+        }
+        rows[rowOf[pair.id1]].ids2.append(pair.id2);
+        count++;
+    }
+
+    if (rows.isEmpty())
+        return;
+
+    diffsTotal += count;
+    matchProgress.setLabelText(QString("Confirming %1 estimated matches ...").arg(count));
+    matchProgress.setMaximum(diffsTotal);
+    matchProgress.setValue(diffsDone);
+
+    scheduleRows(rows, 1, windowNums2);
+}
+
+void LogDiff::confirmVisibleMatches()
+{
+    // the rows in view and the selected ones are made exact once the matching is done
+    if (baselineMode || diffsDone != diffsTotal || diffsFailed)
+        return;
+
+    QTableWidget *t = ui->threadsTable;
+
+    QSet<int> shownRows;
+    int first = t->rowAt(0);
+    int last = t->rowAt(t->viewport()->height() - 1);
+    if (last < 0)
+        last = t->rowCount() - 1;
+    for (int row=first; first>=0 && row<=last; row++)
+        shownRows.insert(row);
+    foreach (QTableWidgetItem *item, t->selectedItems())
+        shownRows.insert(item->row());
+
+    QList<Match> pairs;
+    QHash<QString, QString> shown; // log-1 thread of a row, and its match
+
+    foreach (int row, shownRows) {
+        QTableWidgetItem *similar = t->item(row, 6);
+        if (!similar)
+            continue; // the "other matches" separator
+
+        QString id1 = QString("%1-%2").arg(t->item(row, 0)->text()).arg(t->item(row, 2)->text());
+        QString id2 = QString("%1-%2").arg(t->item(row, 1)->text()).arg(t->item(row, 3)->text());
+
+        shown[id1] = id2;
+        if (similar->data(Qt::UserRole).toBool())
+            pairs.append(Match(-1, -1, id1, id2));
+    }
+
+    if (ui->actionLazyMatching->isChecked())
+        closeCandidates(shown, pairs);
+
+    confirmMatches(pairs);
+}
+
+static bool removalsLowLessThan(const Match &a, const Match &b)
+{
+    return a.removalsLow < b.removalsLow;
+}
+
+void LogDiff::closeCandidates(const QHash<QString, QString> &shown, QList<Match> &pairs)
+{
+    // a lazily matched row is only sure to show the best match once the
+    // estimates that might beat it are exact too
+
+    QHash<QString, QString>::const_iterator it;
+    for (it = shown.constBegin(); it != shown.constEnd(); ++it) {
+        QList<int> row = threadMatches.value(it.key());
+
+        int shownAt = -1;
+        foreach (int i, row)
+            if (matches.at(i).id2 == it.value())
+                shownAt = i;
+        if (shownAt < 0)
+            continue;
+
+        QList<Match> close;
+        foreach (int i, row) {
+            const Match &match = matches.at(i);
+            if (i != shownAt && match.confirmable() && match.removalsLow <= matches.at(shownAt).removalsHigh)
+                close.append(match);
+        }
+
+        // the most promising first, a few at a time
+        qSort(close.begin(), close.end(), removalsLowLessThan);
+        pairs.append(close.mid(0, LAZY_CANDIDATES));
+    }
+}
+
+void LogDiff::updateConfirmed()
+{
+    // the best match of the log-1 threads with a confirmed pair is taken
+    // again, and only their rows and those of the confirmed pairs change.
+    // the rest of the table stays as it is
+
+    QHash<QString, Match> best;
+    QHash<QString, Match> pairs;
+
+    foreach (const Match &pair, confirmed) {
+        pairs[pair.id1 + " " + pair.id2] = pair;
+
+        if (best.contains(pair.id1))
+            continue;
+
+        Match &b = best[pair.id1];
+        foreach (int i, threadMatches.value(pair.id1))
+            if (b.removals < 0 || matches.at(i).removals < b.removals)
+                b = matches.at(i);
+    }
+    confirmed.clear();
+
+    for (int i=0; i<bestMatches.size(); i++) {
+        QString id1 = bestMatches.at(i).id1;
+        if (!best.contains(id1))
+            continue;
+
+        bestMatches[i] = best[id1];
+        if (bestRows.contains(id1))
+            setMatchItems(bestRows[id1], best[id1]);
+    }
+
+    for (int i=0; i<otherMatches.size(); i++) {
+        QString pair = otherMatches.at(i).id1 + " " + otherMatches.at(i).id2;
+        if (!pairs.contains(pair))
+            continue;
+
+        otherMatches[i] = pairs[pair];
+        if (otherRows.contains(pair))
+            setMatchItems(otherRows[pair], pairs[pair]);
+    }
+
+    // and the candidates still close to the rows in view
+    confirmVisibleMatches();
+}
+
+void LogDiff::startMatchProgress(const QString &label, bool slow)
 {
-    matches.clear();
     diffsDone = 0;
     diffsFailed = false;
+    confirming.clear();
+    confirmed.clear();
 
-    matchProgress.setLabelText(QString("Matching %1*%2 threads ...").arg(ids1.size()).arg(ids2.size()));
-    matchProgress.setCancelButton(NULL);
+    matchProgress.setLabelText(label);
+    matchProgress.setCancelButtonText("Cancel");
     matchProgress.setMinimum(0);
-    matchProgress.setMaximum(ids1.size());
+    matchProgress.setMaximum(diffsTotal);
     matchProgress.setMinimumDuration(250);
     matchProgress.setValue(0);    
 
@@ -594,9 +1451,426 @@ void LogDiff::matchThreads(bool &slow)
         matchProgress.show();
         QApplication::processEvents();
     }
+}
+
+void LogDiff::beginCacheSession()
+{
+    // thread samples go by the rows in the windows as split
+    samples.clear();
+
+    cacheVariant = QByteArray::number(diffMode()) + "-" + QByteArray::number(seqKey());
+    matchCache.beginSession();
+}
+
+QByteArray LogDiff::cacheHash(int logNo, const QString &id, const QByteArray &seqHash)
+{
+    if (!isWindowed())
+        return seqHash;
+
+    // the hash is of the whole thread, and times are left out of it. the
+    // rows the window picks tell apart threads that only differ in those
+    int from, to;
+    if (!store.windowRows(logNo, id, logNo == 0 ? window1 : window2, from, to))
+        from = to = -1;
+
+    return seqHash + QString("-%1-%2").arg(from).arg(to).toAscii();
+}
+
+QList<MatchRow> LogDiff::uncachedRows(int logNo2, const QStringList &ids2, const QHash<QString, QByteArray> &seqHashes2,
+        QList<Match> &cached, const QSet<QString> *changed1, const QSet<QString> *changed2)
+{
+    // pairs seen in an earlier session don't need to be diffed again
+
+    QList<MatchRow> rows;
+    foreach (QString id1, ids1) {
+        MatchRow row(id1);
+
+        foreach (QString id2, ids2) {
+            // when following a log, only the pairs that grew
+            if (changed1 && !changed1->contains(id1) && !changed2->contains(id2))
+                continue;
+
+            int removals, additions;
+            if (matchCache.lookup(cacheHash(0, id1, seqHashes1[id1]), cacheHash(logNo2, id2, seqHashes2[id2]),
+                    cacheVariant, removals, additions))
+                cached.append(Match(removals, additions, id1, id2));
+            else
+                row.ids2.append(id2);
+        }
+
+        if (!row.ids2.isEmpty())
+            rows.append(row);
+    }
+
+    return rows;
+}
+
+void LogDiff::matchThreads(bool &slow)
+{
+    matches.clear();
+
+    countWindowLines(0, ids1, window1, windowNums1);
+    countWindowLines(1, ids2, window2, windowNums2);
+
+    diffsTotal = ids1.size() * ids2.size();
+    startMatchProgress(QString("Matching %1*%2 threads ...").arg(ids1.size()).arg(ids2.size()), slow);
+
+    beginCacheSession();
+    startDiffs(uncachedRows(1, ids2, seqHashes2, matches));
+}
+
+void LogDiff::startDiffs(const QList<MatchRow> &rows)
+{
+    diffsDone = matches.size();
+    matchProgress.setValue(diffsDone);
+
+    if (rows.isEmpty()) {
+        selectMatches();
+        return;
+    }
+
+    if (ui->actionLazyMatching->isChecked()) {
+        matchProgress.setLabelText(QString("Estimating %1 thread pairs ...").arg(diffsTotal - diffsDone));
+        scheduleRows(rows, 1, windowNums2, false, true);
+        return;
+    }
+
+    DiffMode mode = diffMode();
+    TraceStore::SeqKey key = seqKey();
+
+    // workers only see the .match files, so they can only compare whole
+    // threads by line, they would load them without regard to the
+    // memory budget, and they don't estimate
+    bool approximate = ui->actionEstimateLong->isChecked();
+    if (workerProcs > 0 && key == TraceStore::LineSeq && !store.isExternal() && !isWindowed() && !approximate) {
+        startShards(mode, rows);
+        return;
+    }
+
+    scheduleRows(rows, 1, windowNums2, approximate);
+}
+
+void LogDiff::scheduleRows(const QList<MatchRow> &rows, int logNo2, const QHash<QString, int> &lineNums2,
+        bool approximate, bool lazy)
+{
+    DiffMode mode = diffMode();
+    TraceStore::SeqKey key = seqKey();
+    int generation = scheduler.generation();
+
+    // a pair costs about as much as its two threads are long
+
+    qint64 totalCost = 0;
+    foreach (const MatchRow &row, rows)
+        foreach (QString id2, row.ids2)
+            totalCost += windowNums1[row.id1] + lineNums2[id2] + 1;
+
+    qint64 maxCost = qMax(Q_INT64_C(1), totalCost / (qMax(1, QThread::idealThreadCount()) * TASKS_PER_THREAD));
+
+    QList<MatchScheduler::Task> tasks;
+
+    foreach (const MatchRow &row, rows) {
+        // rows of giant threads are split, so they can be spread over the workers
+        QStringList ids2;
+        qint64 cost = 0;
+
+        for (int i=0; i<row.ids2.size(); i++) {
+            ids2.append(row.ids2.at(i));
+            cost += windowNums1[row.id1] + lineNums2[row.ids2.at(i)] + 1;
+
+            if (cost < maxCost && i < row.ids2.size()-1)
+                continue;
+
+            if (lazy) {
+                tasks.append(MatchScheduler::Task(new EstimateTask(this, row.id1, ids2, logNo2, &store, key,
+                        window1, window2, &samples, &scheduler, generation), cost));
+            } else {
+                DiffTask *task = new DiffTask(this, sessionDir, mode, row.id1, ids2, logNo2, &store, key,
+                        window1, window2);
+                task->setScheduler(&scheduler, generation);
+                task->setSamples(&samples);
+                if (approximate)
+                    task->setApproximate(APPROX_MIN_ROWS);
+                tasks.append(MatchScheduler::Task(task, cost));
+            }
+
+            ids2.clear();
+            cost = 0;
+        }
+    }
+
+    scheduler.schedule(tasks);
+}
+
+DiffMode LogDiff::diffMode() const
+{
+    // operation-only, path-only, windowed, estimated and lazy comparisons
+    // need the trace store, and only the in-process diff keeps to the memory budget
+    if (ui->actionPatienceDiff->isChecked() || seqKey() != TraceStore::LineSeq || store.isExternal() || isWindowed() ||
+        ui->actionEstimateLong->isChecked() || ui->actionLazyMatching->isChecked())
+        return PatienceDiffMode;
+
+    return GnuDiffMode;
+}
+
+TraceStore::SeqKey LogDiff::seqKey() const
+{
+    if (ui->actionCompareOperations->isChecked())
+        return TraceStore::OperationSeq;
+    if (ui->actionComparePaths->isChecked())
+        return TraceStore::PathSeq;
+
+    return TraceStore::LineSeq;
+}
+
+bool LogDiff::isWindowed() const
+{
+    return !window1.isAll() || !window2.isAll();
+}
+
+void LogDiff::countWindowLines(int logNo, const QStringList &ids, const TimeWindow &window,
+        QHash<QString, int> &windowNums)
+{
+    windowNums.clear();
+
+    foreach (QString id, ids) {
+        int from, to;
+        windowNums[id] = store.windowRows(logNo, id, window, from, to) ? to - from : 0;
+    }
+}
+
+double LogDiff::matchSimilarity(const Match &match)
+{
+    // the share of the log-1 lines in the time window that were kept
+    int lines = windowNums1[match.id1];
+    if (lines == 0)
+        return match.additions ? 0 : 1;
+
+    double similarity = lines - match.removals;
+    return similarity / lines;
+}
+
+QString LogDiff::similarityText(const Match &match)
+{
+    QString text = QString().sprintf("%.0f%%", matchSimilarity(match)*100);
+    return match.approx ? "~" + text : text;
+}
+
+void LogDiff::clearWindow()
+{
+    windowText.clear();
+    window1 = window2 = TimeWindow();
+}
+
+void LogDiff::rematchWindow()
+{
+    // the traces compared against the baseline are matched again as a whole
+    if (baselineMode) {
+        QStringList fnames;
+        foreach (const Candidate &c, candidates)
+            fnames.append(c.fname);
+        compareBaseline(fnames);
+        return;
+    }
+
+    // the logs are already split, the windows just select other rows
+    if (ids2.isEmpty())
+        return;
+
+    stopMatching();
+
+    bool slow = false;
+    matchThreads(slow);
+}
+
+void LogDiff::on_actionTimeWindow_triggered()
+{
+    if (!store.hasTimes(0)) {
+        error("Window error", "Log #1 has no \"Time of Day\" column");
+        return;
+    }
+
+    bool ok;
+    QString text = QInputDialog::getText(this, "Time window",
+            "Compare only the events between two times of day, like \"1:23:45 PM - 1:24:00 PM\".\n"
+            "Leave empty to compare whole threads.",
+            QLineEdit::Normal, windowText, &ok).trimmed();
+    if (!ok)
+        return;
+
+    if (text.isEmpty()) {
+        clearWindow();
+        rematchWindow();
+        return;
+    }
+
+    QStringList ends = text.split('-');
+    QByteArray from = ends.value(0).toAscii();
+    QByteArray to = ends.value(1).toAscii();
+
+    quint32 fromTime, toTime;
+    if (ends.size() != 2 ||
+        !TraceStore::parseTime(from.constData(), from.size(), fromTime) ||
+        !TraceStore::parseTime(to.constData(), to.size(), toTime) ||
+        toTime < fromTime) {
+        error("Window error", QString("Not a time range: %1").arg(text));
+        return;
+    }
+
+    // the end is included, to the second unless given finer
+    toTime += to.contains('.') ? 1 : 1000;
+
+    windowText = text;
+    window1 = window2 = TimeWindow(fromTime, toTime);
+    rematchWindow();
+}
+
+bool LogDiff::anchorTime(int logNo, const QString &logFname, const QString &text, quint32 &time)
+{
+    QHash<quint64, QString> lines;
+    if (!grepFile(logFname, text, lines))
+        return false;
+
+    // the first matching event of each thread, the earliest of them is the anchor
+    bool found = false;
+    foreach (QString line, lines) {
+        quint32 lineTime;
+        if (store.lineTime(logNo, line.toAscii(), lineTime) && (!found || lineTime < time)) {
+            time = lineTime;
+            found = true;
+        }
+    }
+
+    if (!found)
+        error("Window error", QString("\"%1\" not found in %2").arg(text).arg(logFname));
+    return found;
+}
+
+void LogDiff::on_actionAnchorWindow_triggered()
+{
+    const QString &text = ui->searchEdit->text();
+
+    if (baselineMode || ids2.isEmpty() || text.isEmpty()) {
+        error("Window error", "Compare two logs and search for the anchor event first");
+        return;
+    }
+    if (!store.hasTimes(0) || !store.hasTimes(1)) {
+        error("Window error", "Both logs need a \"Time of Day\" column");
+        return;
+    }
+
+    quint32 anchor1, anchor2;
+    if (!anchorTime(0, store.logFname(0), text, anchor1) || !anchorTime(1, store.logFname(1), text, anchor2))
+        return;
+
+    bool ok;
+    int secs = QInputDialog::getInt(this, "Time window",
+            QString("Seconds to compare before and after \"%1\":").arg(text),
+            5, 1, 24*60*60, 1, &ok);
+    if (!ok)
+        return;
+
+    // the same span around the anchor in each log, whenever it happened
+    quint32 span = secs * 1000;
+    window1 = TimeWindow(anchor1 > span ? anchor1 - span : 0, anchor1 + span + 1);
+    window2 = TimeWindow(anchor2 > span ? anchor2 - span : 0, anchor2 + span + 1);
+    windowText.clear();
+
+    rematchWindow();
+}
+
+void LogDiff::stopMatching()
+{
+    // tasks still running read the trace store and the session files, so
+    // they are waited for. they check their generation as they go, between
+    // pairs, slices and every so many gaps of a diff, and kill their diff
+    // or worker process once it is over, so this is short.
+    scheduler.cancel();
+    scheduler.waitForDone();
+    shardPool.waitForDone();
+
+    confirming.clear();
+}
+
+void LogDiff::cancelMatching()
+{
+    scheduler.cancel();
+    diffsFailed = true;
+}
+
+void LogDiff::startShards(DiffMode mode, const QList<MatchRow> &rows)
+{
+    int shards = qMin(rows.size(), workerProcs * SHARDS_PER_WORKER);
+    int threads = qMax(1, QThread::idealThreadCount() / workerProcs);
+
+    // each shard task just waits on its worker process
+    shardPool.setMaxThreadCount(workerProcs);
+
+    // largest rows first, each to the shard with the least work so far
+
+    QList<QPair<qint64, int> > costs;
+    for (int row=0; row<rows.size(); row++) {
+        qint64 cost = 0;
+        foreach (QString id2, rows.at(row).ids2)
+            cost += lineNums1[rows.at(row).id1] + lineNums2[id2] + 1;
+        costs.append(qMakePair(-cost, row));
+    }
+    qSort(costs);
+
+    QVector<QList<MatchRow> > shardRows(shards);
+    QVector<qint64> shardCosts(shards, 0);
+
+    for (int i=0; i<costs.size(); i++) {
+        int least = 0;
+        for (int shard=1; shard<shards; shard++)
+            if (shardCosts[shard] < shardCosts[least])
+                least = shard;
+
+        shardRows[least].append(rows.at(costs.at(i).second));
+        shardCosts[least] -= costs.at(i).first;
+    }
+
+    for (int i=0; i<shards; i++)
+        shardPool.start(new ShardTask(this, sessionDir, mode, threads, shardRows.at(i), &scheduler, scheduler.generation()));
+}
+
+void LogDiff::on_actionCacheSize_triggered()
+{
+    bool ok;
+    int entries = QInputDialog::getInt(this, "Match cache",
+            "Thread pairs kept in the match cache (0 to disable):",
+            matchCache.getMaxEntries(), 0, 100000000, 10000, &ok);
+    if (!ok)
+        return;
+
+    matchCache.setMaxEntries(entries);
+    matchCache.save();
+}
 
-    foreach (QString id1, ids1)
-        QThreadPool::globalInstance()->start(new DiffTask(this, sessionDir, id1, ids2));
+void LogDiff::on_actionMemoryBudget_triggered()
+{
+    bool ok;
+    int mbytes = QInputDialog::getInt(this, "Memory budget",
+            "Memory for loaded logs and comparisons, in MB (0 to keep logs in memory).\n"
+            "With a budget, threads are spilled to disk and read back as needed.\n"
+            "The matches and the table are not part of the budget.",
+            memoryBudgetMB, 0, 1024*1024, 256, &ok);
+    if (!ok || mbytes == memoryBudgetMB)
+        return;
+
+    memoryBudgetMB = mbytes;
+
+    // takes effect when the logs are next loaded, log #1 included
+    baselineFname.clear();
+}
+
+void LogDiff::on_actionWorkerProcesses_triggered()
+{
+    bool ok;
+    int procs = QInputDialog::getInt(this, "Worker processes",
+            "Worker processes used for matching (0 to match in this process):",
+            workerProcs, 0, 256, 1, &ok);
+    if (ok)
+        workerProcs = procs;
 }
 
 QString LogDiff::trimFirstLine(const QString &line)
@@ -611,52 +1885,110 @@ QString LogDiff::trimFirstLine(const QString &line)
     return line.right(line.size()-comma);
 }
 
-bool LogDiff::getFirstLine(const QString &fname, QString &firstLine)
+bool LogDiff::getFirstLine(const QString &id, QString &firstLine)
 {
-    QFile f(fname);
-    if (!f.open(QFile::ReadOnly)) {
-        error("Match error", QString("Could not read %1").arg(fname));
+    QByteArray line;
+    if (!store.rawLine(0, id, 0, line)) {
+        error("Match error", QString("Could not read the first line of %1").arg(id));
         return false;
     }
 
-    firstLine = f.readLine(MAX_LINE_LEN).trimmed();
+    firstLine = line.trimmed();
     return true;
 }
 
+void LogDiff::clearMatchRows()
+{
+    ui->threadsTable->setRowCount(0);
+    bestRows.clear();
+    otherRows.clear();
+}
+
 bool LogDiff::addMatch(const Match &match, const QString &firstLine)
 {
     QTableWidget *t = ui->threadsTable;
     int row = t->rowCount();
     t->insertRow(row);
 
-    QStringList pidtid1 = match.id1.split("-");
-    QStringList pidtid2 = match.id2.split("-");
-
-    QString fname1 = QDir(sessionDir).filePath(QString("0-%1.csv").arg(match.id1));
     QString line;
 
     if (!firstLine.isEmpty()) {
         line = firstLine;
     } else {
-        if (!getFirstLine(fname1, line)) return false;
+        if (!getFirstLine(match.id1, line)) return false;
     }
 
-    double similarity = lineNums1[match.id1] - match.removals;
-    similarity /= lineNums1[match.id1];    
+    setMatchItems(row, match);
+    t->setItem(row, 7, new QTableWidgetItem(trimFirstLine(line)));
+
+    return true;
+}
+
+void LogDiff::setMatchItems(int row, const Match &match)
+{
+    QTableWidget *t = ui->threadsTable;
+
+    QStringList pidtid1 = match.id1.split("-");
+    QStringList pidtid2 = match.id2.split("-");
 
     QString items[] = {
         pidtid1[0],
         pidtid2[0],
         pidtid1[1],
         pidtid2[1],
-        QString::number(lineNums1[match.id1]),
-        QString::number(lineNums2[match.id2]),
-        QString().sprintf("%.0f%%", similarity*100),
-        trimFirstLine(line),
+        QString::number(windowNums1[match.id1]),
+        QString::number(windowNums2[match.id2]),
+        similarityText(match),
     };
-    for (int col=0; col<8; col++)
+    for (int col=0; col<7; col++)
         t->setItem(row, col, new QTableWidgetItem(items[col]));
 
+    if (match.approx) {
+        // the likely range of the estimate, until the row is confirmed
+        Match low = match;
+        Match high = match;
+        low.removals = match.removalsHigh;
+        high.removals = match.removalsLow;
+
+        QTableWidgetItem *similar = t->item(row, 6);
+        similar->setData(Qt::UserRole, match.confirmable());
+        similar->setToolTip(QString().sprintf("%s: %.0f%% to %.0f%%",
+                match.sliced ? "Diffed in slices within the memory budget" : "Estimated",
+                matchSimilarity(low)*100, matchSimilarity(high)*100));
+    }
+}
+
+bool LogDiff::loadBaseline(bool &slow)
+{
+    stopMatching();
+
+    QString fname = ui->log1Edit->text();
+    QFileInfo info(fname);
+
+    // log #1 stays split as long as the file doesn't change
+    if (!sessionDir.isEmpty() && fname == baselineFname &&
+        info.size() == baselineSize && info.lastModified() == baselineModified) {
+        clearCandidates();
+        return true;
+    }
+
+    clearSession();
+    if (!initSession())
+        return false;
+
+    splitOffset1 = 0;
+    if (!splitThreads(0, fname, ids1, lineNums1, seqHashes1, slow, splitOffset1))
+        return false;
+
+    if (lineNums1.size()==0) {
+        error("Load error", QString("Could not read any events: %1").arg(fname));
+        return false;
+    }
+
+    baselineFname = fname;
+    baselineSize = info.size();
+    baselineModified = info.lastModified();
+
     return true;
 }
 
@@ -666,20 +1998,20 @@ void LogDiff::processLogs()
         ui->log2Edit->text().isEmpty())
         return;
 
-    clearSession();
-    initSession();
+    baselineMode = false;
+
+    // a window was chosen for the logs compared before, not for these
+    clearWindow();
 
     bool slow = false;
 
-    if (!splitThreads(0, ids1, lineNums1, slow))
+    if (!loadBaseline(slow))
         return;
-    if (!splitThreads(1, ids2, lineNums2, slow))
+    log2Fname = ui->log2Edit->text();
+    splitOffset2 = 0;
+    if (!splitThreads(1, log2Fname, ids2, lineNums2, seqHashes2, slow, splitOffset2))
         return;
 
-    if (lineNums1.size()==0) {
-        error("Load error", QString("Could not read any events: %1").arg(ui->log1Edit->text()));
-        return;
-    }
     if (lineNums2.size()==0) {
         error("Load error", QString("Could not read any events: %1").arg(ui->log2Edit->text()));
         return;
@@ -688,18 +2020,436 @@ void LogDiff::processLogs()
     matchThreads(slow);
 }
 
-void LogDiff::on_threadsTable_cellDoubleClicked(int row, int)
+void LogDiff::on_actionFollowLogs_toggled(bool on)
 {
-    QString extn = ui->ignoreNumbersCheck->isChecked() ? "match" : "csv";
+    if (on)
+        tailTimer.start(TAIL_POLL_MS);
+    else
+        tailTimer.stop();
+}
+
+void LogDiff::pollLogs()
+{
+    // only a two-log session can be followed, and only between runs
+    if (splitting || baselineMode || sessionDir.isEmpty() || ids2.isEmpty())
+        return;
+    if (diffsFailed || diffsDone != diffsTotal)
+        return;
+
+    if (QFileInfo(baselineFname).size() <= splitOffset1 &&
+        QFileInfo(log2Fname).size() <= splitOffset2)
+        return;
+
+    followLogs();
+}
+
+void LogDiff::followLogs()
+{
+    stopMatching();
+
+    // append what was added to the logs to the threads we already have
+
+    bool slow = false;
+    QSet<QString> changed1;
+    QSet<QString> changed2;
+
+    if (!splitThreads(0, baselineFname, ids1, lineNums1, seqHashes1, slow, splitOffset1, &changed1) ||
+        !splitThreads(1, log2Fname, ids2, lineNums2, seqHashes2, slow, splitOffset2, &changed2)) {
+        ui->actionFollowLogs->setChecked(false);
+        return;
+    }
+
+    QFileInfo info(baselineFname);
+    baselineSize = info.size();
+    baselineModified = info.lastModified();
+
+    if (changed1.isEmpty() && changed2.isEmpty())
+        return;
+
+    // and rescore only the pairs where one of the threads changed
+
+    QList<Match> kept;
+    foreach (Match match, matches)
+        if (!changed1.contains(match.id1) && !changed2.contains(match.id2))
+            kept.append(match);
+    matches = kept;
+
+    countWindowLines(0, ids1, window1, windowNums1);
+    countWindowLines(1, ids2, window2, windowNums2);
+
+    diffsTotal = ids1.size() * ids2.size();
+    startMatchProgress(QString("Updating %1+%2 threads ...").arg(changed1.size()).arg(changed2.size()), slow);
+
+    beginCacheSession();
+    startDiffs(uncachedRows(1, ids2, seqHashes2, matches, &changed1, &changed2));
+}
+
+void LogDiff::on_actionCompareMany_triggered()
+{
+    if (ui->log1Edit->text().isEmpty()) {
+        error("Compare error", "Choose the baseline trace as log #1 first");
+        return;
+    }
+
+    QStringList fnames = QFileDialog::getOpenFileNames(this, "Open traces to compare against log #1", QString());
+    if (fnames.isEmpty())
+        return;
+
+    ui->log2Edit->clear();
+    clearWindow();
+    compareBaseline(fnames);
+}
+
+void LogDiff::compareBaseline(const QStringList &fnames)
+{
+    // windows are cleared when the traces are picked, any window here is
+    // a time of day one set since, anchors are only found in log #2
+    bool slow = false;
+
+    if (!loadBaseline(slow))
+        return;
+
+    baselineMode = true;
+
+    for (int i=0; i<fnames.size(); i++) {
+        candidates.append(Candidate(fnames.at(i)));
+
+        Candidate &c = candidates.last();
+        qint64 offset = 0;
+        if (!splitThreads(i+1, c.fname, c.ids, c.lineNums, c.seqHashes, slow, offset))
+            return;
+
+        if (c.lineNums.size()==0) {
+            error("Load error", QString("Could not read any events: %1").arg(c.fname));
+            return;
+        }
+    }
+
+    countWindowLines(0, ids1, window1, windowNums1);
+
+    diffsTotal = 0;
+    foreach (const Candidate &c, candidates)
+        diffsTotal += ids1.size() * c.ids.size();
+
+    startMatchProgress(QString("Matching %1 threads against %2 traces ...").arg(ids1.size()).arg(candidates.size()), slow);
+
+    beginCacheSession();
+
+    // all traces share the scheduler, so they are matched in parallel
+    for (int i=0; i<candidates.size(); i++) {
+        QList<Match> cached;
+        QList<MatchRow> rows = uncachedRows(i+1, candidates.at(i).ids, candidates.at(i).seqHashes, cached);
+
+        scheduleRows(rows, i+1, candidates.at(i).lineNums);
+
+        addCandidateMatches(i+1, cached);
+    }
+}
+
+void LogDiff::addCandidateMatches(int logNo2, const QList<Match> &newMatches)
+{
+    if (logNo2 < 1 || logNo2 > candidates.size())
+        return;
+
+    Candidate &c = candidates[logNo2-1];
+
+    foreach (Match match, newMatches) {
+        if (!match.approx)
+            matchCache.insert(cacheHash(0, match.id1, seqHashes1[match.id1]),
+                    cacheHash(logNo2, match.id2, c.seqHashes[match.id2]), cacheVariant,
+                    match.removals, match.additions);
+
+        // same choice as selectMatches: the thread keeping most baseline lines
+        Match &best = c.best[match.id1];
+        if (best.removals < 0 || match.removals < best.removals)
+            best = match;
+    }
+
+    diffsDone += newMatches.size();
+
+    if (diffsFailed)
+        return;
+
+    matchProgress.setValue(diffsDone);
+    if (diffsDone == diffsTotal) {
+        matchCache.save();
+        showBaselineReport();
+    }
+}
+
+struct DriftRow {
+    QString id1;
+    int drifts;
+    double minSimilarity;
+};
+
+static bool driftLessThan(const DriftRow &a, const DriftRow &b)
+{
+    if (a.drifts != b.drifts)
+        return a.drifts > b.drifts;
+    return a.minSimilarity < b.minSimilarity;
+}
+
+void LogDiff::showBaselineReport()
+{
+    if (!baselineDialog) {
+        baselineDialog = new QDialog(this);
+        baselineDialog->setWindowTitle("Baseline drift (doubleclick for diff)");
+        baselineDialog->resize(700, 500);
+
+        baselineTable = new QTableWidget(baselineDialog);
+        baselineTable->setEditTriggers(QAbstractItemView::NoEditTriggers);
+        baselineTable->setSelectionMode(QAbstractItemView::SingleSelection);
+        baselineTable->verticalHeader()->setVisible(false);
+        baselineTable->verticalHeader()->setDefaultSectionSize(24);
+
+        QVBoxLayout *layout = new QVBoxLayout(baselineDialog);
+        layout->addWidget(baselineTable);
+
+        connect(baselineTable, SIGNAL(cellDoubleClicked(int,int)), this, SLOT(baselineCellDoubleClicked(int,int)));
+    }
 
+    // baseline threads that drift in most traces come first
+
+    QList<DriftRow> rows;
+    foreach (QString id1, ids1) {
+        DriftRow row;
+        row.id1 = id1;
+        row.drifts = 0;
+        row.minSimilarity = 1;
+
+        foreach (const Candidate &c, candidates) {
+            Match best = c.best.value(id1);
+
+            double similarity = matchSimilarity(best);
+
+            if (best.removals != 0)
+                row.drifts++;
+            row.minSimilarity = qMin(row.minSimilarity, similarity);
+        }
+
+        rows.append(row);
+    }
+
+    qSort(rows.begin(), rows.end(), driftLessThan);
+
+    QStringList cols = QStringList() << "PID" << "TID" << "Lines" << "Drifts";
+    foreach (const Candidate &c, candidates)
+        cols << QFileInfo(c.fname).fileName();
+
+    QTableWidget *t = baselineTable;
+    t->clear();
+    t->setRowCount(rows.size());
+    t->setColumnCount(cols.size());
+    t->setHorizontalHeaderLabels(cols);
+
+    for (int row=0; row<rows.size(); row++) {
+        const QString &id1 = rows.at(row).id1;
+        QStringList pidtid1 = id1.split("-");
+
+        QTableWidgetItem *pidItem = new QTableWidgetItem(pidtid1[0]);
+        pidItem->setData(Qt::UserRole, id1);
+
+        t->setItem(row, 0, pidItem);
+        t->setItem(row, 1, new QTableWidgetItem(pidtid1[1]));
+        t->setItem(row, 2, new QTableWidgetItem(QString::number(windowNums1[id1])));
+        t->setItem(row, 3, new QTableWidgetItem(QString::number(rows.at(row).drifts)));
+
+        for (int i=0; i<candidates.size(); i++) {
+            Match best = candidates.at(i).best.value(id1);
+
+            double similarity = matchSimilarity(best);
+
+            QTableWidgetItem *item = new QTableWidgetItem(QString().sprintf("%.0f%%", similarity*100));
+            item->setData(Qt::UserRole, best.id2);
+            item->setToolTip(QString("Thread %1 in %2").arg(best.id2).arg(candidates.at(i).fname));
+            if (best.removals != 0)
+                item->setBackground(QColor(255, 200, 200));
+
+            t->setItem(row, 4+i, item);
+        }
+    }
+
+    baselineDialog->show();
+    baselineDialog->raise();
+    baselineDialog->activateWindow();
+}
+
+void LogDiff::baselineCellDoubleClicked(int row, int col)
+{
+    if (col < 4)
+        return;
+
+    QString id1 = baselineTable->item(row, 0)->data(Qt::UserRole).toString();
+    QString id2 = baselineTable->item(row, col)->data(Qt::UserRole).toString();
+
+    showDiff(col-3, id1, id2);
+}
+
+void LogDiff::on_actionExportReport_triggered()
+{
+    if (baselineMode || bestMatches.isEmpty()) {
+        error("Export error", "Compare two logs first");
+        return;
+    }
+
+    QString dir = QFileDialog::getExistingDirectory(this, "Export report to", QString());
+    if (dir.isEmpty())
+        return;
+
+    // the growing logs can't be split while the report tasks read the store
+    bool following = tailTimer.isActive();
+    tailTimer.stop();
+
+    exportReport(dir);
+
+    if (following)
+        tailTimer.start(TAIL_POLL_MS);
+}
+
+struct ReportRow {
+    Match match;
+    double similarity;
+};
+
+static bool reportRowLessThan(const ReportRow &a, const ReportRow &b)
+{
+    return a.similarity < b.similarity;
+}
+
+void LogDiff::exportReport(const QString &dir)
+{
+    // least similar threads first, by the scores the matching gave them
+
+    QList<ReportRow> rows;
+    foreach (Match match, bestMatches) {
+        ReportRow row;
+        row.match = match;
+        row.similarity = matchSimilarity(match);
+        rows.append(row);
+    }
+
+    qStableSort(rows.begin(), rows.end(), reportRowLessThan);
+
+    QString htmlFname = QDir(dir).filePath("report.html");
+    QString diffFname = QDir(dir).filePath("report.diff");
+
+    QFile htmlFile(htmlFname);
+    QFile diffFile(diffFname);
+    if (!htmlFile.open(QFile::WriteOnly) || !diffFile.open(QFile::WriteOnly)) {
+        error("Export error", QString("Could not create %1 and %2").arg(htmlFname).arg(diffFname));
+        return;
+    }
+
+    // the diffs are streamed to the file in report order as they finish
+
+    ReportWriter writer(&diffFile);
+    QThreadPool pool;
+
+    QProgressDialog progress;
+    progress.setWindowModality(Qt::ApplicationModal);
+    progress.setLabelText(QString("Exporting %1 thread diffs ...").arg(rows.size()));
+    progress.setMinimum(0);
+    progress.setMaximum(rows.size());
+    progress.setMinimumDuration(250);
+    progress.setValue(0);
+
+    for (int i=0; i<rows.size(); i++) {
+        const Match &match = rows.at(i).match;
+
+        // same content hash, nothing to show
+        if (!isWindowed() && seqHashes1[match.id1] == seqHashes2[match.id2])
+            writer.put(i, QByteArray());
+        else
+            pool.start(new ReportTask(&store, seqKey(), i, match, window1, window2, &writer));
+    }
+
+    while (!pool.waitForDone(100)) {
+        if (progress.wasCanceled())
+            writer.cancel();
+        progress.setValue(writer.written());
+    }
+
+    progress.setValue(rows.size());
+
+    // the summary counts what report.diff shows. the diff there can differ
+    // from the one the matching ran, GNU diff aligns lines its own way and
+    // estimates are only bounds, so the order stays that of the matching
+
+    const char *keys[] = { "whole lines", "operations", "paths" };
+
+    QString html = QString(
+            "<html><head><title>LogDiff report</title></head><body>\n"
+            "<p>%1 vs %2<br>Diffs in report.diff, in the same order<br>"
+            "Threads paired and ordered by %3 on %4, removed and added %4 as counted in report.diff</p>\n"
+            "<table border=\"1\" cellspacing=\"0\" cellpadding=\"3\">\n"
+            "<tr><th>PID1</th><th>PID2</th><th>TID1</th><th>TID2</th><th>Lines1</th><th>Lines2</th>"
+            "<th>Similar</th><th>Removed</th><th>Added</th><th>First line</th></tr>\n")
+            .arg(Qt::escape(baselineFname), Qt::escape(log2Fname),
+                 diffMode() == GnuDiffMode ? "GNU diff" : "patience diff", keys[seqKey()]);
+
+    for (int i=0; i<rows.size(); i++) {
+        // a pair diffed in slices stays a bound, the same slices are exported
+        Match match = rows.at(i).match;
+        if (writer.counts(i, match.removals, match.additions) && !match.sliced) {
+            match.approx = false;
+            match.removalsLow = match.removalsHigh = match.removals;
+        }
+
+        QStringList pidtid1 = match.id1.split("-");
+        QStringList pidtid2 = match.id2.split("-");
+
+        QString line;
+        if (!getFirstLine(match.id1, line))
+            return;
+
+        html += QString("<tr%1><td>%2</td><td>%3</td><td>%4</td><td>%5</td><td>%6</td><td>%7</td>"
+                        "<td>%8</td><td>%9</td><td>%10</td><td>%11</td></tr>\n")
+                .arg(match.removals || match.additions ? " bgcolor=\"#ffc8c8\"" : "")
+                .arg(pidtid1[0]).arg(pidtid2[0]).arg(pidtid1[1]).arg(pidtid2[1])
+                .arg(windowNums1[match.id1]).arg(windowNums2[match.id2])
+                .arg(similarityText(match))
+                .arg(match.removals).arg(match.additions)
+                .arg(Qt::escape(trimFirstLine(line)));
+    }
+
+    html += "</table></body></html>\n";
+    htmlFile.write(html.toUtf8());
+
+    if (writer.hasFailed() || !htmlFile.flush() || !diffFile.flush())
+        error("Export error", QString("Could not write the report to %1").arg(dir));
+    else if (writer.isCanceled())
+        error("Export error", QString("Report export canceled, %1 is incomplete").arg(diffFname));
+}
+
+void LogDiff::on_threadsTable_cellDoubleClicked(int row, int)
+{
     QTableWidget *t = ui->threadsTable;
+    if (!t->item(row, 0))
+        return; // the "other matches" separator
+
     QString pid1 = t->item(row, 0)->text();
     QString pid2 = t->item(row, 1)->text();
     QString tid1 = t->item(row, 2)->text();
     QString tid2 = t->item(row, 3)->text();
 
-    QString fname1 = QDir(sessionDir).filePath(QString("0-%1-%2.%3").arg(pid1).arg(tid1).arg(extn));
-    QString fname2 = QDir(sessionDir).filePath(QString("1-%1-%2.%3").arg(pid2).arg(tid2).arg(extn));
+    showDiff(1, QString("%1-%2").arg(pid1).arg(tid1), QString("%1-%2").arg(pid2).arg(tid2));
+}
+
+void LogDiff::showDiff(int logNo2, const QString &id1, const QString &id2)
+{
+    QString extn = ui->ignoreNumbersCheck->isChecked() ? "match" : "csv";
+
+    QString fname1 = QDir(sessionDir).filePath(QString("0-%1.%2").arg(id1).arg(extn));
+    QString fname2 = QDir(sessionDir).filePath(QString("%1-%2.%3").arg(logNo2).arg(id2).arg(extn));
+
+    // raw threads are only written out when somebody looks at them
+    if (extn == "csv") {
+        if (!store.writeThread(0, id1, fname1) || !store.writeThread(logNo2, id2, fname2)) {
+            error("Match error", QString("Could not write %1 and %2").arg(fname1).arg(fname2));
+            return;
+        }
+    }
 
     QProcess kdiff3Proc;
     if (!kdiff3Proc.startDetached("kdiff3", QStringList() <<
@@ -712,19 +2462,43 @@ void LogDiff::on_threadsTable_cellDoubleClicked(int row, int)
     }
 }
 
-bool LogDiff::grepFile(const QString &fname, const QString &text, QHash<quint64, QString> &matches)
+bool LogDiff::grepFile(const QString &fname, const QString &text, QHash<quint64, QString> &matches,
+        qint64 from, qint64 to)
 {
+    if (PmlReader::isPml(fname))
+        return searchPml(fname, text, matches);
+
+    // extended expressions or fixed strings, as searchPml() takes them
     QStringList args;
-    if (ui->regexpCheck->isChecked())
-        args << "-E";
+    args << (ui->regexpCheck->isChecked() ? "-E" : "-F");
     if (!ui->matchCaseCheck->isChecked())
         args << "-i";
-    args << text
-         << fname;
+    args << "-e" << text;
+
+    // a whole log is grepped by name, the rest of one is fed to grep
+    if (from == 0)
+        args << fname;
 
     QProcess grepProc;
     grepProc.start("grep", args);
 
+    if (from > 0) {
+        QFile logFile(fname);
+        if (!logFile.open(QFile::ReadOnly) || !logFile.seek(from)) {
+            error("Search error", QString("Could not read %1").arg(fname));
+            return false;
+        }
+
+        while (logFile.pos() < to) {
+            QByteArray chunk = logFile.read(qMin((qint64)GREP_CHUNK_SIZE, to - logFile.pos()));
+            if (chunk.isEmpty())
+                break;
+            grepProc.write(chunk);
+            grepProc.waitForBytesWritten(-1);
+        }
+        grepProc.closeWriteChannel();
+    }
+
     if (!grepProc.waitForFinished() || grepProc.exitCode() >= 2) {
         error("Search error", QString("Could not run grep on %1").arg(fname));
         return false;
@@ -735,35 +2509,91 @@ bool LogDiff::grepFile(const QString &fname, const QString &text, QHash<quint64,
         qint64 len = grepProc.readLine(line, sizeof(line));
         if (len <= 0) break;
 
-        quint64 pid, tid;
+        addSearchHit(line, len, matches);
+    }
+
+    return true;
+}
 
-        const char *ptr = line;
+bool LogDiff::searchPml(const QString &fname, const QString &text, QHash<quint64, QString> &matches)
+{
+    // grep can't read a capture, its events are searched as lines
+    PmlReader reader(fname);
 
-        int colMin = min(pidCol, tidCol);
-        int colMax = max(pidCol, tidCol);
+    QString err;
+    if (!reader.open(err)) {
+        error("Search error", err);
+        return false;
+    }
 
-        for (int i=0; i<colMin; i++) {
-            ptr = strchr(ptr, ',');
-            if (ptr) ptr++; else break;
-        }
+    // the extended syntax grep -E takes, or a fixed string as with grep -F
+    QRegExp pattern(text, ui->matchCaseCheck->isChecked() ? Qt::CaseSensitive : Qt::CaseInsensitive,
+            ui->regexpCheck->isChecked() ? QRegExp::RegExp2 : QRegExp::FixedString);
+    if (!pattern.isValid()) {
+        error("Search error", QString("Not a regular expression: %1").arg(text));
+        return false;
+    }
 
-        ((pidCol < tidCol) ? pid : tid) = atoi(ptr+1);
+    for (int event=0; event<reader.eventCount(); event++) {
+        QByteArray line;
+        if (reader.eventLine(event, line) && pattern.indexIn(QString::fromUtf8(line)) >= 0)
+            addSearchHit(line.constData(), line.size(), matches);
+    }
 
-        for (int i=colMin; i<colMax; i++) {
-            ptr = strchr(ptr, ',');
-            if (ptr) ptr++; else break;
-        }
+    return true;
+}
+
+void LogDiff::addSearchHit(const char *line, qint64 len, QHash<quint64, QString> &matches)
+{
+    quint64 pid, tid;
 
-        ((pidCol < tidCol) ? tid : pid) = atoi(ptr+1);
+    const char *ptr = line;
 
-        quint64 id = tid | (pid << 32);
-        if (!matches.contains(id))
-            matches[id] = QByteArray(line, len).trimmed();
+    int colMin = min(pidCol, tidCol);
+    int colMax = max(pidCol, tidCol);
+
+    for (int i=0; i<colMin; i++) {
+        ptr = strchr(ptr, ',');
+        if (ptr) ptr++; else break;
     }
 
-    return true;
+    ((pidCol < tidCol) ? pid : tid) = atoi(ptr+1);
+
+    for (int i=colMin; i<colMax; i++) {
+        ptr = strchr(ptr, ',');
+        if (ptr) ptr++; else break;
+    }
+
+    ((pidCol < tidCol) ? tid : pid) = atoi(ptr+1);
+
+    quint64 id = tid | (pid << 32);
+    if (!matches.contains(id))
+        matches[id] = QByteArray(line, len).trimmed();
 }
 
+bool LogDiff::searchLog(int logNo, const QString &text, QHash<quint64, QString> &lines)
+{
+    SearchHits &hits = searchHits[logNo];
+    qint64 end = logNo == 0 ? splitOffset1 : splitOffset2;
+
+    QString query = QString("%1%2 %3").arg(ui->regexpCheck->isChecked()).arg(ui->matchCaseCheck->isChecked()).arg(text);
+    if (hits.query != query || end < hits.searched) {
+        hits = SearchHits();
+        hits.query = query;
+    }
+
+    // refreshes while matching or following only search what the log grew by
+    if (hits.searched == 0 || end > hits.searched) {
+        if (!grepFile(store.logFname(logNo), text, hits.lines, hits.searched, end)) {
+            hits = SearchHits();
+            return false;
+        }
+        hits.searched = end;
+    }
+
+    lines = hits.lines;
+    return true;
+}
 
 void LogDiff::on_searchBtn_clicked()
 {
@@ -777,9 +2607,10 @@ void LogDiff::on_searchBtn_clicked()
         return;
     }
 
-    if (!grepFile(ui->log1Edit->text(), text, lines1))
+    // the logs as split
+    if (!searchLog(0, text, lines1))
         return;
-    if (!grepFile(ui->log2Edit->text(), text, lines2))
+    if (!searchLog(1, text, lines2))
         return;
 
     QList<Match> bestMatchesFiltered;
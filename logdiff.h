@@ -2,12 +2,27 @@
 #define LOGDIFF_H
 
 #include <QMainWindow>
+#include <QDialog>
+#include <QTableWidget>
 
 #include <QThread>
 #include <QProgressDialog>
 #include <QRunnable>
 #include <QHash>
+#include <QMutex>
+#include <QWaitCondition>
 #include <QEvent>
+#include <QDateTime>
+#include <QSet>
+#include <QTimer>
+#include <QVector>
+#include <QStringList>
+#include <QThreadPool>
+
+#include "matchcache.h"
+#include "matchscheduler.h"
+#include "patiencediff.h"
+#include "tracestore.h"
 
 namespace Ui {
 class LogDiff;
@@ -18,36 +33,167 @@ struct Match {
         removals(removals),
         additions(additions),
         id1(id1),
-        id2(id2) { }
+        id2(id2),
+        approx(false),
+        sliced(false),
+        removalsLow(removals),
+        removalsHigh(removals) { }
 
     int removals;
     int additions;
     QString id1;
     QString id2;
 
+    // estimated from sampled k-mers, the removals are likely within the bounds
+    bool approx;
+    bool sliced; // diffed a slice at a time within the memory budget, diffing again won't make it exact
+    int removalsLow;
+    int removalsHigh;
+
+    // an estimate that an exact diff can replace
+    bool confirmable() const { return approx && !sliced; }
+
     /*double similarity() const {
         double s = lines1 - removals;
         return s / (double)lines1;
     }*/
 };
 
-class DiffTask: public QRunnable
+// one row of the N*M comparison space: a log-1 thread against some log-2 threads
+struct MatchRow {
+    MatchRow(const QString &id1=QString(), const QStringList &ids2=QStringList()):
+        id1(id1),
+        ids2(ids2) { }
+
+    QString id1;
+    QStringList ids2;
+};
+
+// The k-mer samples of the threads of a session, each taken once by the
+// first task that needs it and shared by all the others
+class ThreadSamples
+{
+public:
+    void clear();
+
+    // the k-mers of the rows of a thread in the window, one in rate. a
+    // thread over the memory budget is read a slice at a time
+    bool sample(const TraceStore *store, TraceStore::SeqKey seqKey, int logNo, const QString &id,
+            const TimeWindow &window, int rate, const DiffCancel *cancel, QVector<quint64> &sample, QString &error);
+
+private:
+    // false if the caller is to take the sample and insert() it, or
+    // abandon() it. waits if another task is taking it already
+    bool find(const QString &key, QVector<quint64> &sample);
+    void insert(const QString &key, const QVector<quint64> &sample);
+    void abandon(const QString &key);
+
+    static bool sampleThread(const TraceStore *store, TraceStore::SeqKey seqKey, int logNo, const QString &id,
+            const TimeWindow &window, int rate, const DiffCancel *cancel, QVector<quint64> &sample, QString &error);
+
+    QMutex mutex;
+    QWaitCondition taken;
+    QHash<QString, QVector<quint64> > samples;
+    QSet<QString> taking;
+};
+
+enum DiffMode {
+    GnuDiffMode,        // external "diff", one process per log-1 thread
+    PatienceDiffMode    // in-process anchor-based diff, for very long threads
+};
+
+class DiffTask: public QRunnable, public DiffCancel
 {
 public:
-    DiffTask(QObject *parent, const QString &sessionDir, const QString &id1, const QStringList &ids2):
+    DiffTask(QObject *parent, const QString &sessionDir, DiffMode mode, const QString &id1, const QStringList &ids2,
+            int logNo2=1, const TraceStore *store=NULL, TraceStore::SeqKey seqKey=TraceStore::LineSeq,
+            const TimeWindow &window1=TimeWindow(), const TimeWindow &window2=TimeWindow()):
         QRunnable(),
         parent(parent),
-        sessionDir(sessionDir), id1(id1), ids2(ids2) { }
+        sessionDir(sessionDir), mode(mode), id1(id1), ids2(ids2), logNo2(logNo2),
+        store(store), seqKey(seqKey), window1(window1), window2(window2),
+        scheduler(NULL), generation(0), approxRows(0), samples(NULL) { }
+
+    // lets the task stop early once the scheduler has moved on
+    void setScheduler(const MatchScheduler *scheduler, int generation) {
+        this->scheduler = scheduler;
+        this->generation = generation;
+    }
+
+    // pairs with this many rows are estimated rather than diffed
+    void setApproximate(int minRows) { approxRows = minRows; }
+
+    // where the thread samples of the session are shared, needed to estimate
+    void setSamples(ThreadSamples *samples) { this->samples = samples; }
 
     void run();
+    bool compare(QList<Match> &matches, QString &error);
+    bool isCanceled() const { return canceled(); }
 
 private:
+    bool compareGnuDiff(QList<Match> &matches, QString &error);
+    bool comparePatience(QList<Match> &matches, QString &error);
+    bool compareBudgeted(MemoryBudget *budget, const QString &id2, Match &match, QString &error);
+    bool estimatePair(const QString &id2, QVector<quint64> &sample1, int &rows1,
+            QList<Match> &matches, bool &done, QString &error);
+    bool threadSample(int logNo, const QString &id, QVector<quint64> &sample, QString &error);
+    bool windowRows(int logNo, const QString &id, int &from, int &to, QString &error);
+    bool sequence(int logNo, const QString &id, QVector<quint64> &seq, QString &error, int from=0, int to=-1);
+    bool loadSequence(const QString &fname, QVector<quint64> &seq);
+    bool canceled() const;
     void postError(const QString &error);
 
     QObject *parent;
     QString sessionDir;
+    DiffMode mode;
     QString id1;
     QStringList ids2;
+    int logNo2;
+
+    const TraceStore *store;
+    TraceStore::SeqKey seqKey;
+    TimeWindow window1; // of log #1
+    TimeWindow window2; // of the log compared against it
+
+    const MatchScheduler *scheduler;
+    int generation;
+    int approxRows;
+    ThreadSamples *samples;
+};
+
+// Estimates every pair of a row from thread signatures, for lazy matching.
+// Nothing is diffed, that waits until the row is looked at.
+class EstimateTask: public QRunnable, public DiffCancel
+{
+public:
+    EstimateTask(QObject *parent, const QString &id1, const QStringList &ids2, int logNo2,
+            const TraceStore *store, TraceStore::SeqKey seqKey, const TimeWindow &window1, const TimeWindow &window2,
+            ThreadSamples *samples, const MatchScheduler *scheduler, int generation):
+        QRunnable(),
+        parent(parent), id1(id1), ids2(ids2), logNo2(logNo2),
+        store(store), seqKey(seqKey), window1(window1), window2(window2),
+        samples(samples), scheduler(scheduler), generation(generation) { }
+
+    void run();
+    bool isCanceled() const;
+
+private:
+    bool estimate(QList<Match> &matches, QString &error);
+    bool signThread(int logNo, const QString &id, const TimeWindow &window, ThreadSignature &sig, QString &error);
+
+    QObject *parent;
+    QString id1;
+    QStringList ids2;
+    int logNo2;
+
+    const TraceStore *store;
+    TraceStore::SeqKey seqKey;
+    TimeWindow window1;
+    TimeWindow window2;
+
+    ThreadSamples *samples;
+    const MatchScheduler *scheduler;
+    int generation;
 };
 
 const QEvent::Type ThreadMatchEventType = (QEvent::Type)9493;
@@ -55,20 +201,50 @@ const QEvent::Type ThreadErrorEventType = (QEvent::Type)9494;
 
 class ThreadMatchEvent: public QEvent {
 public:
-    ThreadMatchEvent(QList<Match> *matches):
+    ThreadMatchEvent(QList<Match> *matches, int logNo2=1, int generation=0):
         QEvent(ThreadMatchEventType),
-        matches(matches) { }
+        matches(matches),
+        logNo2(logNo2),
+        generation(generation) { }
 
     QList<Match> *matches;
+    int logNo2;
+    int generation; // results of a canceled run are dropped
+};
+
+// a trace compared against the baseline in one-versus-many mode
+struct Candidate {
+    Candidate(const QString &fname=QString()):
+        fname(fname) { }
+
+    QString fname;
+
+    QStringList ids;
+    QHash<QString, int> lineNums;
+    QHash<QString, QByteArray> seqHashes;
+
+    QHash<QString, Match> best; // by baseline thread
 };
 
 class ThreadErrorEvent: public QEvent {
 public:
-    ThreadErrorEvent(const QString &error):
+    ThreadErrorEvent(const QString &error, int generation=0):
         QEvent(ThreadErrorEventType),
-        error(error) { }
+        error(error),
+        generation(generation) { }
 
     QString error;
+    int generation;
+};
+
+// The first line of each thread a search hit in a log, kept so that a
+// refresh only has to search what the log grew by since
+struct SearchHits {
+    SearchHits(): searched(0) { }
+
+    QString query; // the search text and options
+    qint64 searched; // bytes of the log searched
+    QHash<quint64, QString> lines;
 };
 
 class LogDiff : public QMainWindow
@@ -91,26 +267,83 @@ private slots:
 
     void on_searchBtn_clicked();
 
+    void on_actionWorkerProcesses_triggered();
+    void on_actionCacheSize_triggered();
+    void on_actionMemoryBudget_triggered();
+    void on_actionTimeWindow_triggered();
+    void on_actionAnchorWindow_triggered();
+    void on_actionCompareMany_triggered();
+    void on_actionExportReport_triggered();
+
+    void on_actionFollowLogs_toggled(bool on);
+
+    void baselineCellDoubleClicked(int row, int col);
+    void pollLogs();
+    void cancelMatching();
+    void confirmVisibleMatches();
+
 private:
     Ui::LogDiff *ui;
 
     void clearSession();
+    void clearCandidates();
     bool initSession();
     void error(const QString &title, const QString &text);
 
     void processLogs();
-    bool splitThreads(int logNo, QStringList &ids, QHash<QString, int> &lineNums, bool &slow);
+    bool loadBaseline(bool &slow);
+    bool splitThreads(int logNo, const QString &logFname, QStringList &ids, QHash<QString, int> &lineNums,
+            QHash<QString, QByteArray> &seqHashes, bool &slow, qint64 &endOffset, QSet<QString> *changed=NULL);
+    bool splitLog(int logNo, const QString &logFname, QStringList &ids, QHash<QString, int> &lineNums,
+            QHash<QString, QByteArray> &seqHashes, bool &slow, qint64 &endOffset, QSet<QString> *changed);
+    void followLogs();
     void customEvent(QEvent *event);
+    void startMatchProgress(const QString &label, bool slow);
+    void beginCacheSession();
+    QByteArray cacheHash(int logNo, const QString &id, const QByteArray &seqHash);
+    QList<MatchRow> uncachedRows(int logNo2, const QStringList &ids2, const QHash<QString, QByteArray> &seqHashes2,
+            QList<Match> &cached, const QSet<QString> *changed1=NULL, const QSet<QString> *changed2=NULL);
     void matchThreads(bool &slow);
+    void startDiffs(const QList<MatchRow> &rows);
+    void scheduleRows(const QList<MatchRow> &rows, int logNo2, const QHash<QString, int> &lineNums2,
+            bool approximate=false, bool lazy=false);
+    DiffMode diffMode() const;
+    TraceStore::SeqKey seqKey() const;
+    bool isWindowed() const;
+    void countWindowLines(int logNo, const QStringList &ids, const TimeWindow &window,
+            QHash<QString, int> &windowNums);
+    double matchSimilarity(const Match &match);
+    QString similarityText(const Match &match);
+    bool anchorTime(int logNo, const QString &logFname, const QString &text, quint32 &time);
+    void clearWindow();
+    void rematchWindow();
+    void stopMatching();
+    void startShards(DiffMode mode, const QList<MatchRow> &rows);
     void selectMatches();
+    void confirmMatches(const QList<Match> &pairs);
+    void closeCandidates(const QHash<QString, QString> &shown, QList<Match> &pairs);
+    void updateConfirmed();
+
+    void compareBaseline(const QStringList &fnames);
+    void addCandidateMatches(int logNo2, const QList<Match> &newMatches);
+    void showBaselineReport();
 
-    bool getFirstLine(const QString &fname, QString &firstLine);
+    void showDiff(int logNo2, const QString &id1, const QString &id2);
+    void exportReport(const QString &dir);
+
+    bool getFirstLine(const QString &id, QString &firstLine);
     QString trimFirstLine(const QString &line);
     void addMatches(const QList<Match> &best, const QList<Match> &other,
             const QHash<quint64, QString> firstLines1, const QHash<quint64, QString> firstLines2);
     bool addMatch(const Match &match, const QString &firstLine);
+    void setMatchItems(int row, const Match &match);
+    void clearMatchRows();
 
-    bool grepFile(const QString &fname, const QString &text, QHash<quint64, QString> &matches);
+    bool searchLog(int logNo, const QString &text, QHash<quint64, QString> &lines);
+    bool grepFile(const QString &fname, const QString &text, QHash<quint64, QString> &matches,
+            qint64 from=0, qint64 to=-1);
+    bool searchPml(const QString &fname, const QString &text, QHash<quint64, QString> &matches);
+    void addSearchHit(const char *line, qint64 len, QHash<quint64, QString> &matches);
 
     // fields
 
@@ -124,17 +357,64 @@ private:
     QStringList ids1;
     QStringList ids2;
 
+    QString log2Fname;
+    qint64 splitOffset1;
+    qint64 splitOffset2;
+    QTimer tailTimer;
+
     QHash<QString, int> lineNums1;
     QHash<QString, int> lineNums2;
 
+    TimeWindow window1;
+    TimeWindow window2;
+    QString windowText;
+
+    // lines of each thread in the time window, all of them without one
+    QHash<QString, int> windowNums1;
+    QHash<QString, int> windowNums2;
+
+    QHash<QString, QByteArray> seqHashes1;
+    QHash<QString, QByteArray> seqHashes2;
+
+    TraceStore store;
+    MatchCache matchCache;
+    QByteArray cacheVariant;
+
     int diffsDone;
     bool diffsFailed;
 
+    int workerProcs;
+    int memoryBudgetMB;
+    MatchScheduler scheduler;
+    QThreadPool shardPool;
+
+    SearchHits searchHits[2];
+    ThreadSamples samples;
+
     QList<Match> matches;
     QList<Match> bestMatches;
     QList<Match> otherMatches;
+    QSet<QString> confirming; // estimated pairs being diffed exactly
+    QHash<QString, int> estimates; // where in matches each estimated pair is
+    QHash<QString, QList<int> > threadMatches; // where in matches the pairs of each log-1 thread are
+    QList<Match> confirmed; // estimates made exact since the table was filled
+    QTimer confirmTimer; // the rows in view are confirmed once scrolling stops
+
+    QHash<QString, int> bestRows; // table row of the best match of each log-1 thread
+    QHash<QString, int> otherRows; // table row of each other match, by pair
     QProgressDialog matchProgress;
 
+    QString baselineFname;
+    qint64 baselineSize;
+    QDateTime baselineModified;
+
+    bool baselineMode;
+    bool splitting; // a log is being split, it can't be followed meanwhile
+    int diffsTotal;
+    QList<Candidate> candidates;
+    QDialog *baselineDialog;
+    QTableWidget *baselineTable;
+
 };
 
 #endif // LOGDIFF_H
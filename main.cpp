@@ -1,5 +1,8 @@
 #include <QApplication>
 #include "logdiff.h"
+#include "matchworker.h"
+
+#include <string.h>
 
 #pragma warning(disable:4996)
 
@@ -8,7 +11,14 @@ int main(int argc, char *argv[])
     //freopen("logdiff.log", "wb", stdout);
     //setbuf(stdout, NULL);
 
+    if (argc > 1 && !strcmp(argv[1], "--match-worker")) {
+        QCoreApplication a(argc, argv);
+        return runMatchWorker(a.arguments());
+    }
+
     QApplication a(argc, argv);
+    a.setApplicationName("LogDiff");
+
     LogDiff w;
     w.show();
     
@@ -0,0 +1,161 @@
+#include "matchcache.h"
+
+#include <QDataStream>
+#include <QDir>
+#include <QFile>
+#include <QFileInfo>
+#include <QVector>
+#include <QtAlgorithms>
+
+#define CACHE_MAGIC   0x4c444d43 // "LDMC"
+#define CACHE_VERSION 2
+
+static QByteArray cacheKey(const QByteArray &hash1, const QByteArray &hash2, const QByteArray &variant)
+{
+    return hash1 + hash2 + variant;
+}
+
+bool MatchCache::load(const QString &fname)
+{
+    this->fname = fname;
+
+    entries.clear();
+    dirty = false;
+
+    QFile f(fname);
+    if (!f.open(QFile::ReadOnly))
+        return false;
+
+    QDataStream in(&f);
+
+    quint32 magic, version, count;
+    in >> magic >> version >> stamp >> count;
+    if (in.status() != QDataStream::Ok || magic != CACHE_MAGIC || version != CACHE_VERSION) {
+        stamp = 0;
+        return false;
+    }
+
+    entries.reserve(count);
+
+    for (quint32 i=0; i<count; i++) {
+        QByteArray key;
+        Entry entry;
+        in >> key >> entry.removals >> entry.additions >> entry.stamp;
+        if (in.status() != QDataStream::Ok) {
+            // keep what we could read, the rest is gone
+            dirty = true;
+            break;
+        }
+
+        entries[key] = entry;
+    }
+
+    return true;
+}
+
+bool MatchCache::save()
+{
+    if (!dirty || fname.isEmpty())
+        return true;
+
+    evict();
+
+    QDir().mkpath(QFileInfo(fname).path());
+
+    // write a new file and swap it in, so a crash never leaves a truncated cache
+    QString tmpFname = fname + ".tmp";
+
+    QFile f(tmpFname);
+    if (!f.open(QFile::WriteOnly))
+        return false;
+
+    QDataStream out(&f);
+    out << (quint32)CACHE_MAGIC << (quint32)CACHE_VERSION << stamp << (quint32)entries.size();
+
+    QHash<QByteArray, Entry>::const_iterator it;
+    for (it = entries.constBegin(); it != entries.constEnd(); ++it)
+        out << it.key() << it->removals << it->additions << it->stamp;
+
+    f.close();
+    if (out.status() != QDataStream::Ok || f.error() != QFile::NoError) {
+        QFile::remove(tmpFname);
+        return false;
+    }
+
+    QFile::remove(fname);
+    if (!QFile::rename(tmpFname, fname))
+        return false;
+
+    dirty = false;
+    return true;
+}
+
+void MatchCache::setMaxEntries(int entries)
+{
+    maxEntries = entries;
+    dirty = true;
+}
+
+bool MatchCache::lookup(const QByteArray &hash1, const QByteArray &hash2, const QByteArray &variant,
+        int &removals, int &additions)
+{
+    if (maxEntries <= 0)
+        return false;
+
+    QHash<QByteArray, Entry>::iterator it = entries.find(cacheKey(hash1, hash2, variant));
+    if (it == entries.end())
+        return false;
+
+    removals = it->removals;
+    additions = it->additions;
+
+    if (it->stamp != stamp) {
+        it->stamp = stamp;
+        dirty = true;
+    }
+
+    return true;
+}
+
+void MatchCache::insert(const QByteArray &hash1, const QByteArray &hash2, const QByteArray &variant,
+        int removals, int additions)
+{
+    if (maxEntries <= 0)
+        return;
+
+    entries[cacheKey(hash1, hash2, variant)] = Entry(removals, additions, stamp);
+    dirty = true;
+}
+
+void MatchCache::evict()
+{
+    if (entries.size() <= maxEntries)
+        return;
+
+    // find the stamp below which entries have to go
+
+    QVector<quint32> stamps;
+    stamps.reserve(entries.size());
+    foreach (const Entry &entry, entries)
+        stamps.append(entry.stamp);
+
+    qSort(stamps);
+    quint32 cutoff = maxEntries > 0 ? stamps.at(stamps.size() - maxEntries) : stamps.last() + 1;
+
+    QHash<QByteArray, Entry>::iterator it = entries.begin();
+    while (it != entries.end()) {
+        if (it->stamp < cutoff)
+            it = entries.erase(it);
+        else
+            ++it;
+    }
+
+    // entries from the cutoff session itself, if there are still too many
+    it = entries.begin();
+    while (entries.size() > maxEntries && it != entries.end()) {
+        if (it->stamp == cutoff)
+            it = entries.erase(it);
+        else
+            ++it;
+    }
+}
@@ -0,0 +1,53 @@
+#ifndef MATCHCACHE_H
+#define MATCHCACHE_H
+
+#include <QByteArray>
+#include <QHash>
+#include <QString>
+
+#define DEFAULT_CACHE_ENTRIES 200000
+
+// Pairwise diff results kept across sessions. Entries are keyed by the
+// content hashes of the two normalized thread sequences plus a variant
+// string for the comparison options, so an unchanged thread pair is reused
+// whatever trace it came from. The least recently used entries are evicted
+// once there are more than maxEntries.
+class MatchCache
+{
+public:
+    MatchCache(): stamp(0), maxEntries(DEFAULT_CACHE_ENTRIES), dirty(false) { }
+
+    bool load(const QString &fname);
+    bool save();
+
+    void setMaxEntries(int entries);
+    int getMaxEntries() const { return maxEntries; }
+
+    // entries used from now on are more recent than all previous ones
+    void beginSession() { stamp++; }
+
+    bool lookup(const QByteArray &hash1, const QByteArray &hash2, const QByteArray &variant,
+            int &removals, int &additions);
+    void insert(const QByteArray &hash1, const QByteArray &hash2, const QByteArray &variant,
+            int removals, int additions);
+
+private:
+    struct Entry {
+        Entry(qint32 removals=0, qint32 additions=0, quint32 stamp=0):
+            removals(removals), additions(additions), stamp(stamp) { }
+
+        qint32 removals;
+        qint32 additions;
+        quint32 stamp;
+    };
+
+    void evict();
+
+    QString fname;
+    QHash<QByteArray, Entry> entries;
+    quint32 stamp;
+    int maxEntries;
+    bool dirty;
+};
+
+#endif // MATCHCACHE_H
@@ -0,0 +1,138 @@
+#include "matchscheduler.h"
+
+#include <QThread>
+#include <QtAlgorithms>
+
+class SchedulerWorker: public QRunnable
+{
+public:
+    SchedulerWorker(MatchScheduler *scheduler, int index):
+        QRunnable(),
+        scheduler(scheduler), index(index) { }
+
+    void run();
+
+private:
+    MatchScheduler *scheduler;
+    int index;
+};
+
+void SchedulerWorker::run()
+{
+    // runs until there is nothing left to take or steal
+    for (;;) {
+        QRunnable *task = scheduler->take(index);
+        if (!task)
+            return;
+
+        bool autoDelete = task->autoDelete();
+        task->run();
+        if (autoDelete)
+            delete task;
+    }
+}
+
+static bool costGreaterThan(const MatchScheduler::Task &a, const MatchScheduler::Task &b)
+{
+    return a.cost > b.cost;
+}
+
+MatchScheduler::MatchScheduler():
+    currentGeneration(0)
+{
+    int workers = qMax(1, QThread::idealThreadCount());
+
+    queues.resize(workers);
+    queuedCost.fill(0, workers);
+    running.fill(false, workers);
+
+    pool.setMaxThreadCount(workers);
+}
+
+MatchScheduler::~MatchScheduler()
+{
+    cancel();
+    waitForDone();
+}
+
+int MatchScheduler::generation() const
+{
+    QMutexLocker locker(&mutex);
+    return currentGeneration;
+}
+
+bool MatchScheduler::isCurrent(int generation) const
+{
+    QMutexLocker locker(&mutex);
+    return generation == currentGeneration;
+}
+
+void MatchScheduler::schedule(QList<Task> tasks)
+{
+    qStableSort(tasks.begin(), tasks.end(), costGreaterThan);
+
+    QMutexLocker locker(&mutex);
+
+    foreach (const Task &task, tasks) {
+        int least = 0;
+        for (int i=1; i<queues.size(); i++)
+            if (queuedCost[i] < queuedCost[least])
+                least = i;
+
+        queues[least].append(task);
+        queuedCost[least] += task.cost;
+    }
+
+    // idle workers are started too, they have something to steal
+    for (int i=0; i<queues.size(); i++) {
+        if (!running[i] && !tasks.isEmpty()) {
+            running[i] = true;
+            pool.start(new SchedulerWorker(this, i));
+        }
+    }
+}
+
+QRunnable *MatchScheduler::take(int worker)
+{
+    QMutexLocker locker(&mutex);
+
+    // our own queue first, then the one with the most work left
+    int victim = worker;
+    if (queues[worker].isEmpty()) {
+        victim = -1;
+        for (int i=0; i<queues.size(); i++)
+            if (!queues[i].isEmpty() && (victim < 0 || queuedCost[i] > queuedCost[victim]))
+                victim = i;
+
+        if (victim < 0) {
+            running[worker] = false;
+            return NULL;
+        }
+    }
+
+    Task task = queues[victim].takeFirst();
+    queuedCost[victim] -= task.cost;
+
+    return task.runnable;
+}
+
+void MatchScheduler::cancel()
+{
+    QMutexLocker locker(&mutex);
+
+    for (int i=0; i<queues.size(); i++) {
+        foreach (const Task &task, queues[i])
+            if (task.runnable->autoDelete())
+                delete task.runnable;
+
+        queues[i].clear();
+        queuedCost[i] = 0;
+    }
+
+    currentGeneration++;
+}
+
+void MatchScheduler::waitForDone()
+{
+    pool.waitForDone();
+}
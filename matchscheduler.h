@@ -0,0 +1,52 @@
+#ifndef MATCHSCHEDULER_H
+#define MATCHSCHEDULER_H
+
+#include <QList>
+#include <QMutex>
+#include <QRunnable>
+#include <QThreadPool>
+#include <QVector>
+
+// Runs matching tasks on a fixed set of worker threads, each with its own
+// queue. Tasks are dealt out largest first to the queue with the least work,
+// and a worker whose queue runs dry steals the largest task left in the
+// fullest other queue, so the giant pairs don't end up last.
+//
+// Cancelling drops everything still queued and starts a new generation.
+// Running tasks are left to notice that theirs is no longer current.
+class MatchScheduler
+{
+public:
+    struct Task {
+        Task(QRunnable *runnable=NULL, qint64 cost=0):
+            runnable(runnable), cost(cost) { }
+
+        QRunnable *runnable;
+        qint64 cost;
+    };
+
+    MatchScheduler();
+    ~MatchScheduler();
+
+    int generation() const;
+    bool isCurrent(int generation) const;
+
+    void schedule(QList<Task> tasks);
+    void cancel();
+    void waitForDone();
+
+private:
+    friend class SchedulerWorker;
+
+    QRunnable *take(int worker);
+
+    mutable QMutex mutex;
+    QVector<QList<Task> > queues;
+    QVector<qint64> queuedCost;
+    QVector<bool> running;
+    int currentGeneration;
+
+    QThreadPool pool;
+};
+
+#endif // MATCHSCHEDULER_H
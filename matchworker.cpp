@@ -0,0 +1,210 @@
+#include "matchworker.h"
+
+#include <QApplication>
+#include <QFile>
+#include <QMutex>
+
+#include <stdio.h>
+
+#define MAX_SHARD_ATTEMPTS 3
+
+// Worker protocol, one record per line:
+//
+//   stdin:  <id1> <id2> <id2> ...
+//   stdout: M <removals> <additions> <id1> <id2>
+//           E <error text>
+
+class WorkerRowTask: public QRunnable
+{
+public:
+    WorkerRowTask(const QString &sessionDir, DiffMode mode, const MatchRow &row, QFile *out, QMutex *outMutex):
+        QRunnable(),
+        sessionDir(sessionDir), mode(mode), row(row),
+        out(out), outMutex(outMutex) { }
+
+    void run();
+
+private:
+    QString sessionDir;
+    DiffMode mode;
+    MatchRow row;
+
+    QFile *out;
+    QMutex *outMutex;
+};
+
+void WorkerRowTask::run()
+{
+    DiffTask task(NULL, sessionDir, mode, row.id1, row.ids2);
+
+    QList<Match> matches;
+    QString error;
+
+    QByteArray text;
+
+    if (!task.compare(matches, error)) {
+        text = "E " + error.simplified().toAscii() + "\n";
+    } else {
+        foreach (Match match, matches)
+            text += QString("M %1 %2 %3 %4\n")
+                    .arg(match.removals).arg(match.additions)
+                    .arg(match.id1).arg(match.id2).toAscii();
+    }
+
+    QMutexLocker locker(outMutex);
+    out->write(text);
+    out->flush();
+}
+
+int runMatchWorker(const QStringList &args)
+{
+    // logdiff --match-worker <sessionDir> <mode> <threads>
+    if (args.size() < 5)
+        return 2;
+
+    QString sessionDir = args.at(2);
+    DiffMode mode = (DiffMode)args.at(3).toInt();
+    int threads = args.at(4).toInt();
+
+    QFile in;
+    QFile out;
+    if (!in.open(stdin, QFile::ReadOnly) || !out.open(stdout, QFile::WriteOnly))
+        return 2;
+
+    QMutex outMutex;
+
+    QThreadPool pool;
+    if (threads > 0)
+        pool.setMaxThreadCount(threads);
+
+    // rows are started as they come in; each task only loads the
+    // sequences of its own threads
+    for (;;) {
+        QByteArray line = in.readLine();
+        if (line.isEmpty()) break;
+
+        QStringList ids = QString(line).split(' ', QString::SkipEmptyParts);
+        if (ids.isEmpty()) continue;
+
+        ids.last() = ids.last().trimmed();
+        QString id1 = ids.takeFirst();
+
+        pool.start(new WorkerRowTask(sessionDir, mode, MatchRow(id1, ids), &out, &outMutex));
+    }
+
+    pool.waitForDone();
+    return 0;
+}
+
+bool ShardTask::readResults(QProcess &workerProc, QList<Match> &matches, QString &error)
+{
+    while (workerProc.canReadLine()) {
+        QString line = QString(workerProc.readLine()).trimmed();
+
+        if (line.startsWith("E ")) {
+            error = line.mid(2);
+            return false;
+        }
+
+        QStringList fields = line.split(' ');
+        if (fields.size() != 5 || fields[0] != "M") {
+            error = QString("Unexpected match worker output: %1").arg(line);
+            return false;
+        }
+
+        matches.append(Match(fields[1].toInt(), fields[2].toInt(), fields[3], fields[4]));
+    }
+
+    return true;
+}
+
+bool ShardTask::runWorker(QList<Match> &matches, QString &error, bool &fatal)
+{
+    QProcess workerProc;
+
+    QStringList args;
+    args << "--match-worker";
+    args << sessionDir;
+    args << QString::number(mode);
+    args << QString::number(threads);
+
+    workerProc.start(QCoreApplication::applicationFilePath(), args);
+
+    if (!workerProc.waitForStarted()) {
+        error = QString("Could not start match worker %1").arg(QCoreApplication::applicationFilePath());
+        fatal = true;
+        return false;
+    }
+
+    int expected = 0;
+    foreach (const MatchRow &row, rows) {
+        workerProc.write(QString("%1 %2\n").arg(row.id1).arg(row.ids2.join(" ")).toAscii());
+        expected += row.ids2.size();
+    }
+    workerProc.closeWriteChannel();
+
+    for (;;) {
+        if (!readResults(workerProc, matches, error)) {
+            // the worker reported an error, running it again won't help
+            workerProc.kill();
+            workerProc.waitForFinished();
+            fatal = true;
+            return false;
+        }
+
+        if (workerProc.state() == QProcess::NotRunning)
+            break;
+
+        if (!scheduler->isCurrent(generation)) {
+            workerProc.kill();
+            workerProc.waitForFinished();
+            fatal = true;
+            return false;
+        }
+
+        workerProc.waitForReadyRead(1000);
+    }
+
+    // whatever was left in the pipe when the worker exited
+    if (!readResults(workerProc, matches, error)) {
+        fatal = true;
+        return false;
+    }
+
+    if (workerProc.exitStatus() != QProcess::NormalExit ||
+        workerProc.exitCode() != 0 ||
+        matches.size() != expected) {
+        error = QString("Match worker failed on a shard of %1 threads (%2 of %3 results)")
+                .arg(rows.size()).arg(matches.size()).arg(expected);
+        return false;
+    }
+
+    return true;
+}
+
+void ShardTask::run()
+{
+    QString error;
+
+    for (int attempt=0; attempt<MAX_SHARD_ATTEMPTS; attempt++) {
+        if (!scheduler->isCurrent(generation))
+            return;
+
+        QList<Match> *matches = new QList<Match>();
+        bool fatal = false;
+
+        if (runWorker(*matches, error, fatal)) {
+            QApplication::postEvent(parent, new ThreadMatchEvent(matches, 1, generation));
+            // the gui thread will delete matches
+            return;
+        }
+
+        delete matches;
+
+        if (fatal)
+            break;
+    }
+
+    if (scheduler->isCurrent(generation))
+        QApplication::postEvent(parent, new ThreadErrorEvent(error, generation));
+}
@@ -0,0 +1,41 @@
+#ifndef MATCHWORKER_H
+#define MATCHWORKER_H
+
+#include <QProcess>
+#include <QRunnable>
+
+#include "logdiff.h"
+
+// Runs a shard of rows in a separate "logdiff --match-worker" process and
+// posts the matches back like a DiffTask does. If the worker crashes, only
+// this shard is started over.
+class ShardTask: public QRunnable
+{
+public:
+    ShardTask(QObject *parent, const QString &sessionDir, DiffMode mode, int threads, const QList<MatchRow> &rows,
+            const MatchScheduler *scheduler, int generation):
+        QRunnable(),
+        parent(parent),
+        sessionDir(sessionDir), mode(mode), threads(threads), rows(rows),
+        scheduler(scheduler), generation(generation) { }
+
+    void run();
+
+private:
+    bool runWorker(QList<Match> &matches, QString &error, bool &fatal);
+    bool readResults(QProcess &workerProc, QList<Match> &matches, QString &error);
+
+    QObject *parent;
+    QString sessionDir;
+    DiffMode mode;
+    int threads;
+    QList<MatchRow> rows;
+
+    const MatchScheduler *scheduler;
+    int generation; // the worker is killed when this run is canceled
+};
+
+// entry point of the worker process, called from main()
+int runMatchWorker(const QStringList &args);
+
+#endif // MATCHWORKER_H
@@ -0,0 +1,387 @@
+#include "patiencediff.h"
+
+#include <QHash>
+#include <QtAlgorithms>
+
+#include <math.h>
+
+// lines repeating more often than this are not used as histogram anchors
+#define MAX_CHAIN_LEN 64
+
+// lines the gaps may be rescanned for, per line compared, before the
+// rest is aligned greedily
+#define MAX_SCANS_PER_LINE 8
+
+// gaps examined between checks whether the diff was canceled
+#define RANGES_PER_CANCEL_CHECK 1024
+
+// fewer sampled k-mers than this say too little about a thread
+#define MIN_SAMPLES 64
+
+// k-mers a signature is meant to keep
+#define SIGNATURE_SIZE 128
+
+// z for a 95% confidence interval
+#define CONFIDENCE_Z 1.96
+
+quint64 hashLine(const char *data, int len)
+{
+    quint64 h = Q_UINT64_C(14695981039346656037);
+    for (int i=0; i<len; i++) {
+        h ^= (unsigned char)data[i];
+        h *= Q_UINT64_C(1099511628211);
+    }
+    return h;
+}
+
+struct DiffRange {
+    DiffRange(int a0=0, int a1=0, int b0=0, int b1=0):
+        a0(a0), a1(a1), b0(b0), b1(b1) { }
+
+    int a0, a1;
+    int b0, b1;
+};
+
+struct LineOcc {
+    LineOcc(): countA(0), countB(0), posA(-1), posB(-1) { }
+
+    int countA, countB;
+    int posA, posB; // first occurrence on each side
+};
+
+// longest subsequence of anchors (already ordered by position in a)
+// that is also increasing in b, using patience sorting
+static void longestIncreasing(const QVector<Anchor> &anchors, QVector<Anchor> &lis)
+{
+    QVector<int> tails;
+    QVector<int> prev(anchors.size(), -1);
+
+    for (int i=0; i<anchors.size(); i++) {
+        int b = anchors[i].second;
+
+        int lo=0, hi=tails.size();
+        while (lo < hi) {
+            int mid = (lo+hi)/2;
+            if (anchors[tails[mid]].second < b)
+                lo = mid+1;
+            else
+                hi = mid;
+        }
+
+        if (lo > 0)
+            prev[i] = tails[lo-1];
+        if (lo == tails.size())
+            tails.append(i);
+        else
+            tails[lo] = i;
+    }
+
+    lis.resize(tails.size());
+
+    int k = tails.isEmpty() ? -1 : tails.last();
+    for (int i=lis.size()-1; i>=0; i--) {
+        lis[i] = anchors[k];
+        k = prev[k];
+    }
+}
+
+// lines matched one after the other, skipping ahead to the nearest line
+// that lines up again within MAX_CHAIN_LEN. linear, but not the best alignment
+static int alignGreedy(const QVector<quint64> &a, const QVector<quint64> &b, const DiffRange &r,
+        QVector<Anchor> *common)
+{
+    int matched = 0;
+
+    int i = r.a0;
+    int j = r.b0;
+    while (i < r.a1 && j < r.b1) {
+        if (a[i] == b[j]) {
+            if (common) common->append(Anchor(i, j));
+            i++;
+            j++;
+            matched++;
+            continue;
+        }
+
+        int skipA = 0;
+        for (int k=1; k<=MAX_CHAIN_LEN && i+k<r.a1; k++)
+            if (a[i+k] == b[j]) { skipA = k; break; }
+
+        int skipB = 0;
+        for (int k=1; k<=MAX_CHAIN_LEN && j+k<r.b1; k++)
+            if (b[j+k] == a[i]) { skipB = k; break; }
+
+        if (!skipA && !skipB) {
+            i++;
+            j++;
+        } else if (!skipA || (skipB && skipB <= skipA)) {
+            j += skipB;
+        } else {
+            i += skipA;
+        }
+    }
+
+    return matched;
+}
+
+// returns the number of lines a and b have in common, and the common
+// lines themselves if asked for (in no particular order). -1 if canceled
+static int diffRanges(const QVector<quint64> &a, const QVector<quint64> &b, QVector<Anchor> *common,
+        const DiffCancel *cancel)
+{
+    int matched = 0;
+
+    // a gap is rescanned each time it is split. uneven splits would rescan
+    // most of it over and over, so the rescans are capped
+    qint64 scanned = 0;
+    qint64 maxScanned = (qint64)(a.size() + b.size()) * MAX_SCANS_PER_LINE;
+
+    // ranges still to be examined. an explicit stack, since a
+    // thread with many gaps would otherwise recurse very deep.
+    QVector<DiffRange> ranges;
+    ranges.append(DiffRange(0, a.size(), 0, b.size()));
+
+    for (int counter=1; !ranges.isEmpty(); counter++) {
+        if (cancel && counter % RANGES_PER_CANCEL_CHECK == 0 && cancel->isCanceled())
+            return -1;
+
+        DiffRange r = ranges.last();
+        ranges.pop_back();
+
+        while (r.a0 < r.a1 && r.b0 < r.b1 && a[r.a0] == b[r.b0]) {
+            if (common) common->append(Anchor(r.a0, r.b0));
+            r.a0++;
+            r.b0++;
+            matched++;
+        }
+        while (r.a0 < r.a1 && r.b0 < r.b1 && a[r.a1-1] == b[r.b1-1]) {
+            r.a1--;
+            r.b1--;
+            if (common) common->append(Anchor(r.a1, r.b1));
+            matched++;
+        }
+
+        if (r.a0 == r.a1 || r.b0 == r.b1)
+            continue;
+
+        scanned += (r.a1 - r.a0) + (r.b1 - r.b0);
+        if (scanned > maxScanned) {
+            matched += alignGreedy(a, b, r, common);
+            continue;
+        }
+
+        QHash<quint64, LineOcc> occs;
+        occs.reserve(r.a1 - r.a0);
+
+        for (int i=r.a0; i<r.a1; i++) {
+            LineOcc &occ = occs[a[i]];
+            if (!occ.countA++)
+                occ.posA = i;
+        }
+
+        for (int i=r.b0; i<r.b1; i++) {
+            QHash<quint64, LineOcc>::iterator it = occs.find(b[i]);
+            if (it == occs.end())
+                continue;
+            if (!it->countB++)
+                it->posB = i;
+        }
+
+        // patience: anchor on the lines that are unique on both sides
+
+        QVector<Anchor> uniques;
+        for (int i=r.a0; i<r.a1; i++) {
+            const LineOcc &occ = *occs.constFind(a[i]);
+            if (occ.countA == 1 && occ.countB == 1)
+                uniques.append(Anchor(i, occ.posB));
+        }
+
+        if (!uniques.isEmpty()) {
+            QVector<Anchor> lis;
+            longestIncreasing(uniques, lis);
+
+            int a0 = r.a0;
+            int b0 = r.b0;
+            foreach (const Anchor &anchor, lis) {
+                if (common) common->append(anchor);
+                ranges.append(DiffRange(a0, anchor.first, b0, anchor.second));
+                a0 = anchor.first+1;
+                b0 = anchor.second+1;
+            }
+            ranges.append(DiffRange(a0, r.a1, b0, r.b1));
+
+            matched += lis.size();
+            continue;
+        }
+
+        // histogram: no unique lines, so split on the rarest common one
+
+        int bestPos = -1;
+        int bestCount = 0;
+        for (int i=r.a0; i<r.a1; i++) {
+            const LineOcc &occ = *occs.constFind(a[i]);
+            if (occ.posA != i || occ.countB == 0)
+                continue;
+            if (bestPos < 0 || occ.countA < bestCount) {
+                bestPos = i;
+                bestCount = occ.countA;
+            }
+        }
+
+        if (bestPos < 0)
+            continue; // nothing in common
+
+        if (bestCount > MAX_CHAIN_LEN) {
+            // only highly repetitive lines left, peeling them off one chain
+            // at a time would take a rescan per chain
+            matched += alignGreedy(a, b, r, common);
+            continue;
+        }
+
+        int ai = bestPos;
+        int bi = occs.constFind(a[bestPos])->posB;
+
+        int before = 0;
+        while (ai-before > r.a0 && bi-before > r.b0 && a[ai-before-1] == b[bi-before-1])
+            before++;
+
+        int after = 1;
+        while (ai+after < r.a1 && bi+after < r.b1 && a[ai+after] == b[bi+after])
+            after++;
+
+        if (common)
+            for (int i=-before; i<after; i++)
+                common->append(Anchor(ai+i, bi+i));
+
+        ranges.append(DiffRange(r.a0, ai-before, r.b0, bi-before));
+        ranges.append(DiffRange(ai+after, r.a1, bi+after, r.b1));
+
+        matched += before + after;
+    }
+
+    return matched;
+}
+
+bool patienceDiff(const QVector<quint64> &a, const QVector<quint64> &b, int &removals, int &additions,
+        const DiffCancel *cancel)
+{
+    int matched = diffRanges(a, b, NULL, cancel);
+    if (matched < 0)
+        return false;
+
+    removals = a.size() - matched;
+    additions = b.size() - matched;
+    return true;
+}
+
+bool patienceAlign(const QVector<quint64> &a, const QVector<quint64> &b, QVector<Anchor> &common,
+        const DiffCancel *cancel)
+{
+    common.clear();
+    if (diffRanges(a, b, &common, cancel) < 0)
+        return false;
+
+    qSort(common);
+    return true;
+}
+
+void sampleKmers(const QVector<quint64> &seq, QVector<quint64> &sample, int rate)
+{
+    sample.clear();
+
+    for (int i=0; i+KMER_LEN<=seq.size(); i++) {
+        quint64 h = Q_UINT64_C(14695981039346656037);
+        for (int k=0; k<KMER_LEN; k++) {
+            h ^= seq.at(i+k);
+            h *= Q_UINT64_C(1099511628211);
+        }
+
+        // keep by the hash alone, so both sides keep the same k-mers
+        if ((h >> 32) % rate == 0)
+            sample.append(h);
+    }
+
+    qSort(sample);
+}
+
+static bool estimateKept(const QVector<quint64> &sample1, int len1, const QVector<quint64> &sample2, int len2,
+        int minSamples, int &common, int &low, int &high)
+{
+    int n = sample1.size();
+    if (n < qMax(1, minSamples))
+        return false;
+
+    // k-mers of the first sample that the second has too, counting repeats
+    int shared = 0;
+    for (int i=0, j=0; i<n && j<sample2.size(); ) {
+        if (sample1.at(i) < sample2.at(j)) {
+            i++;
+        } else if (sample2.at(j) < sample1.at(i)) {
+            j++;
+        } else {
+            shared++;
+            i++;
+            j++;
+        }
+    }
+
+    // Wilson interval of the share of k-mers kept
+    double p = (double)shared / n;
+    double z2 = CONFIDENCE_Z * CONFIDENCE_Z;
+    double center = (p + z2/(2*n)) / (1 + z2/n);
+    double spread = CONFIDENCE_Z * sqrt(p*(1-p)/n + z2/(4.0*n*n)) / (1 + z2/n);
+
+    // A changed line breaks the KMER_LEN k-mers over it. Changes in a trace
+    // usually come in runs, which breaks about as many k-mers as lines, but
+    // scattered changes break up to KMER_LEN times as many. The high bound
+    // allows for that.
+    double pLow = qMax(0.0, center - spread);
+    double pHigh = pow(qMin(1.0, center + spread), 1.0 / KMER_LEN);
+
+    int most = qMin(len1, len2);
+    common = qMin(most, (int)(p * len1 + 0.5));
+    low = qMin(common, (int)(pLow * len1));
+    high = qMax(common, qMin(most, (int)(pHigh * len1 + 0.5)));
+
+    return true;
+}
+
+bool estimateCommon(const QVector<quint64> &sample1, int len1, const QVector<quint64> &sample2, int len2,
+        int &common, int &low, int &high)
+{
+    return estimateKept(sample1, len1, sample2, len2, MIN_SAMPLES, common, low, high);
+}
+
+int signatureRate(int rows)
+{
+    int rate = 1;
+    while ((qint64)rate * SIGNATURE_SIZE < rows)
+        rate *= 2;
+    return rate;
+}
+
+// the part of a sample that a coarser rate would have kept
+static void thinSample(const QVector<quint64> &sample, int rate, QVector<quint64> &thinned)
+{
+    thinned.clear();
+    foreach (quint64 h, sample)
+        if ((h >> 32) % rate == 0)
+            thinned.append(h);
+}
+
+void estimateSimilar(const ThreadSignature &a, const ThreadSignature &b, int &common, int &low, int &high)
+{
+    int rate = qMax(a.rate, b.rate);
+
+    QVector<quint64> sample1;
+    QVector<quint64> sample2;
+    thinSample(a.sample, rate, sample1);
+    thinSample(b.sample, rate, sample2);
+
+    // signatures are small by design, any sample at all is taken for an estimate
+    if (!estimateKept(sample1, a.rows, sample2, b.rows, 1, common, low, high)) {
+        common = 0;
+        low = 0;
+        high = qMin(a.rows, b.rows);
+    }
+}
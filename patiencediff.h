@@ -0,0 +1,78 @@
+#ifndef PATIENCEDIFF_H
+#define PATIENCEDIFF_H
+
+#include <QPair>
+#include <QVector>
+
+// lines per sampled k-mer
+#define KMER_LEN 4
+
+// one in this many k-mers kept by default
+#define KMER_RATE 16
+
+// a line of a and the line of b it was matched with
+typedef QPair<int, int> Anchor;
+
+// Asked now and then during a long diff whether to give up on it
+class DiffCancel
+{
+public:
+    virtual ~DiffCancel() { }
+    virtual bool isCanceled() const = 0;
+};
+
+// 64-bit FNV-1a, used to intern normalized lines so they can be compared as integers
+quint64 hashLine(const char *data, int len);
+
+// Counts the lines of a that have no counterpart in b (removals) and the
+// lines of b that have no counterpart in a (additions).
+//
+// Lines that occur exactly once in both sides are used as anchors (patience
+// diff) and only the gaps between anchors are examined further. Gaps without
+// unique lines are split on their least frequent common line (histogram diff).
+// Gaps of highly repetitive lines, and whatever is left once the gaps have
+// been rescanned a few times over, are lined up greedily, which keeps this
+// close to linear where the classic O(ND) diff blows up.
+//
+// False if cancel said to give up before the diff was done.
+bool patienceDiff(const QVector<quint64> &a, const QVector<quint64> &b, int &removals, int &additions,
+        const DiffCancel *cancel=NULL);
+
+// The same diff, returning the matched lines ordered by position, which is
+// what it takes to print the differences.
+bool patienceAlign(const QVector<quint64> &a, const QVector<quint64> &b, QVector<Anchor> &common,
+        const DiffCancel *cancel=NULL);
+
+// The k-mers (runs of consecutive lines) of a sequence whose hash falls in a
+// fixed share of the hash space, one in rate, sorted. Two sequences sample
+// the same k-mers wherever they agree, so their samples can stand in for them
+// when comparing. A sequence read in slices is sampled whole if each slice
+// but the first starts with the last KMER_LEN-1 lines of the one before.
+void sampleKmers(const QVector<quint64> &seq, QVector<quint64> &sample, int rate=KMER_RATE);
+
+// Estimates how many of the len1 lines sampled in sample1 are kept in the
+// sequence sampled in sample2, from the share of the k-mers of the first that
+// the second has too. low and high bound it with about 95% confidence. False
+// if the sample is too small to tell.
+bool estimateCommon(const QVector<quint64> &sample1, int len1, const QVector<quint64> &sample2, int len2,
+        int &common, int &low, int &high);
+
+// A sample of a few hundred k-mers of a thread at most, small enough to be
+// compared against every thread of the other log. Rates are powers of two,
+// so the sample of a short thread can be thinned to that of a long one.
+struct ThreadSignature {
+    ThreadSignature(): rows(0), rate(1) { }
+
+    int rows;
+    int rate;
+    QVector<quint64> sample;
+};
+
+// the rate to sample a thread of this many rows at for its signature
+int signatureRate(int rows);
+
+// The same estimate as above from two signatures. Pairs with nothing to go
+// by get bounds that span all that is possible.
+void estimateSimilar(const ThreadSignature &a, const ThreadSignature &b, int &common, int &low, int &high);
+
+#endif // PATIENCEDIFF_H
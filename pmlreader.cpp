@@ -0,0 +1,471 @@
+#include "pmlreader.h"
+
+#include <QDateTime>
+#include <QStringList>
+#include <QtEndian>
+
+#define PML_VERSION     9
+#define PML_HEADER_SIZE 0x3a8
+
+// bytes of the capture read at a time
+#define PML_WINDOW_SIZE (1 << 20)
+
+// fields of the file header
+#define HDR_IS64          0x008
+#define HDR_NUM_EVENTS    0x234
+#define HDR_EVENT_OFFSETS 0x248
+#define HDR_PROCESS_TABLE 0x250
+#define HDR_STRING_TABLE  0x258
+
+// fields of a process table entry
+#define PROC_INDEX 0
+#define PROC_PID   4
+#define PROC_NAME  64
+
+// fields of an event header
+#define EV_PROCESS     0
+#define EV_TID         4
+#define EV_CLASS       8
+#define EV_OPERATION   12
+#define EV_DATE        28
+#define EV_RESULT      36
+#define EV_STACK_DEPTH 40
+#define EV_DETAILS_LEN 44
+#define EV_HEADER_SIZE 52
+
+// an entry of the event offsets array: offset and flags
+#define EVENT_OFFSET_SIZE 5
+
+enum PmlEventClass {
+    ProcessClass = 1,
+    RegistryClass,
+    FileSystemClass,
+    ProfilingClass,
+    NetworkClass
+};
+
+enum PmlOperation {
+    LoadImageOper = 5,
+
+    RegOpenKeyOper = 0,
+    RegCreateKeyOper = 1,
+    RegQueryKeyOper = 3,
+    RegSetValueOper = 4,
+    RegQueryValueOper = 5,
+    RegEnumValueOper = 6,
+    RegEnumKeyOper = 7,
+    RegSetInfoKeyOper = 8,
+    RegLoadKeyOper = 12,
+    RegRenameKeyOper = 14
+};
+
+#define FILETIME_UNIX_EPOCH Q_UINT64_C(116444736000000000)
+#define TICKS_PER_DAY       Q_INT64_C(864000000000)
+
+static const char *processOpers[] = {
+    "Process Defined", "Process Create", "Process Exit", "Thread Create", "Thread Exit",
+    "Load Image", "Thread Profile", "Process Start", "Process Statistics", "System Statistics"
+};
+
+static const char *registryOpers[] = {
+    "RegOpenKey", "RegCreateKey", "RegCloseKey", "RegQueryKey", "RegSetValue", "RegQueryValue",
+    "RegEnumValue", "RegEnumKey", "RegSetInfoKey", "RegDeleteKey", "RegDeleteValue", "RegFlushKey",
+    "RegLoadKey", "RegUnloadKey", "RegRenameKey", "RegQueryMultipleValueKey", "RegSetKeySecurity",
+    "RegQueryKeySecurity"
+};
+
+static const char *fileSystemOpers[] = {
+    "VolumeDismount", "VolumeMount", "FASTIO_MDL_WRITE_COMPLETE", "WriteFile2",
+    "FASTIO_MDL_READ_COMPLETE", "ReadFile2", "QueryOpen", "FASTIO_CHECK_IF_POSSIBLE",
+    "IRP_MJ_12", "IRP_MJ_11", "IRP_MJ_10", "IRP_MJ_9", "IRP_MJ_8",
+    "FASTIO_NOTIFY_STREAM_FO_CREATION", "FASTIO_RELEASE_FOR_CC_FLUSH", "FASTIO_ACQUIRE_FOR_CC_FLUSH",
+    "FASTIO_RELEASE_FOR_MOD_WRITE", "FASTIO_ACQUIRE_FOR_MOD_WRITE",
+    "FASTIO_RELEASE_FOR_SECTION_SYNCHRONIZATION", "CreateFileMapping", "CreateFile", "CreatePipe",
+    "IRP_MJ_CLOSE", "ReadFile", "WriteFile", "QueryInformationFile", "SetInformationFile",
+    "QueryEAFile", "SetEAFile", "FlushBuffersFile", "QueryVolumeInformation", "SetVolumeInformation",
+    "DirectoryControl", "FileSystemControl", "DeviceIoControl", "InternalDeviceIoControl", "Shutdown",
+    "LockUnlockFile", "CloseFile", "CreateMailSlot", "QuerySecurityFile", "SetSecurityFile", "Power",
+    "SystemControl", "DeviceChange", "QueryFileQuota", "SetFileQuota", "PlugAndPlay"
+};
+
+static const char *profilingOpers[] = {
+    "Thread Profiling", "Process Profiling", "Debug Output Profiling"
+};
+
+static const char *networkOpers[] = {
+    "Unknown", "Other", "Send", "Receive", "Accept", "Connect", "Disconnect", "Reconnect",
+    "Retransmit", "TCPCopy"
+};
+
+#define COUNT_OF(a) (sizeof(a) / sizeof((a)[0]))
+
+PmlReader::PmlReader(const QString &fname):
+    file(fname),
+    size(0),
+    is64(false),
+    ptrSize(4),
+    numEvents(0),
+    stringTable(0),
+    utcOffsetMs(0)
+{
+}
+
+bool PmlReader::isPml(const QString &fname)
+{
+    QFile f(fname);
+    return f.open(QFile::ReadOnly) && f.read(4) == "PML_";
+}
+
+quint16 PmlReader::PmlBytes::u16(quint64 offset) const
+{
+    return has(offset, 2) ? qFromLittleEndian<quint16>(at(offset)) : 0;
+}
+
+quint32 PmlReader::PmlBytes::u32(quint64 offset) const
+{
+    return has(offset, 4) ? qFromLittleEndian<quint32>(at(offset)) : 0;
+}
+
+quint64 PmlReader::PmlBytes::u64(quint64 offset) const
+{
+    return has(offset, 8) ? qFromLittleEndian<quint64>(at(offset)) : 0;
+}
+
+bool PmlReader::read(quint64 offset, quint64 len, PmlBytes &bytes) const
+{
+    if (offset > (quint64)size || len > (quint64)size - offset)
+        return false;
+
+    bytes.start = offset;
+
+    QMutexLocker locker(&mutex);
+
+    // the events are mostly read in order, the next one is usually in the window
+    if (!window.has(offset, len)) {
+        if (!file.seek(offset))
+            return false;
+
+        // what doesn't fit in a window is read on its own
+        if (len > PML_WINDOW_SIZE) {
+            bytes.bytes = file.read(len);
+            return (quint64)bytes.bytes.size() == len;
+        }
+
+        window.start = offset;
+        window.bytes = file.read(PML_WINDOW_SIZE);
+        if (!window.has(offset, len))
+            return false;
+    }
+
+    bytes.bytes = window.bytes.mid(offset - window.start, len);
+    return true;
+}
+
+bool PmlReader::open(QString &error)
+{
+    if (!file.open(QFile::ReadOnly)) {
+        error = QString("Error opening %1").arg(file.fileName());
+        return false;
+    }
+
+    size = file.size();
+
+    PmlBytes header;
+    if (!read(0, PML_HEADER_SIZE, header) || !header.bytes.startsWith("PML_")) {
+        error = QString("Not a PML file: %1").arg(file.fileName());
+        return false;
+    }
+    if (header.u32(4) != PML_VERSION) {
+        error = QString("Unsupported PML version %1: %2").arg(header.u32(4)).arg(file.fileName());
+        return false;
+    }
+
+    is64 = header.u32(HDR_IS64) != 0;
+    ptrSize = is64 ? 8 : 4;
+    numEvents = header.u32(HDR_NUM_EVENTS);
+    stringTable = header.u64(HDR_STRING_TABLE);
+
+    // the offsets of the events are kept, 5 bytes an event
+    PmlBytes count;
+    if (!read(header.u64(HDR_EVENT_OFFSETS), (quint64)numEvents * EVENT_OFFSET_SIZE, offsets) ||
+        !read(stringTable, 4, count)) {
+        error = QString("Truncated PML file: %1").arg(file.fileName());
+        return false;
+    }
+
+    // process table: count, the process indexes, then the offsets of the entries
+
+    quint64 processTable = header.u64(HDR_PROCESS_TABLE);
+    PmlBytes table;
+    quint32 numProcesses = read(processTable, 4, table) ? table.u32(processTable) : 0;
+    if (!read(processTable, 4 + (quint64)numProcesses * 8, table)) {
+        error = QString("Truncated PML process table: %1").arg(file.fileName());
+        return false;
+    }
+
+    for (quint32 i=0; i<numProcesses; i++) {
+        quint64 offset = processTable + table.u32(processTable + 4 + numProcesses*4 + i*4);
+
+        PmlBytes entry;
+        if (!read(offset, PROC_NAME + 4, entry))
+            continue;
+
+        PmlProcess process;
+        process.pid = entry.u32(offset + PROC_PID);
+        process.name = tableString(entry.u32(offset + PROC_NAME));
+
+        processes[entry.u32(offset + PROC_INDEX)] = process;
+    }
+
+    // the local time zone, taken once for the whole capture
+    PmlBytes first;
+    if (numEvents > 0 && read(offsets.u32(offsets.start), EV_HEADER_SIZE, first)) {
+        qint64 ms = (qint64)(first.u64(first.start + EV_DATE) - FILETIME_UNIX_EPOCH) / 10000;
+
+        QDateTime local = QDateTime::fromMSecsSinceEpoch(ms);
+        utcOffsetMs = QDateTime(local.date(), local.time(), Qt::UTC).toMSecsSinceEpoch() - ms;
+    }
+
+    return true;
+}
+
+QByteArray PmlReader::tableString(quint32 index) const
+{
+    // string table: count, offsets, then each string as a byte size and UTF-16
+    PmlBytes table;
+    if (!read(stringTable, 4, table) || index >= table.u32(stringTable) ||
+        !read(stringTable + 4 + (quint64)index*4, 4, table))
+        return QByteArray();
+
+    quint64 offset = stringTable + table.u32(table.start);
+
+    PmlBytes str;
+    if (!read(offset, 4, str) || !read(offset + 4, str.u32(offset), str))
+        return QByteArray();
+
+    return QString::fromUtf16((const ushort *)str.bytes.constData(), str.bytes.size() / 2).toUtf8();
+}
+
+QByteArray PmlReader::detailString(const PmlBytes &bytes, quint64 &offset, quint16 info) const
+{
+    // the top bit tells ASCII from UTF-16, the rest is the length in chars
+    bool ascii = info & 0x8000;
+    quint32 chars = info & 0x7fff;
+    quint32 len = ascii ? chars : chars*2;
+
+    if (!bytes.has(offset, len))
+        return QByteArray();
+
+    QByteArray str = ascii ?
+            QByteArray((const char *)bytes.at(offset), chars) :
+            QString::fromUtf16((const ushort *)bytes.at(offset), chars).toUtf8();
+
+    offset += len;
+    return str;
+}
+
+QByteArray PmlReader::timeOfDay(quint64 filetime) const
+{
+    // as procmon writes it: "1:23:45.1234567 PM" in local time
+    qint64 ticks = (qint64)(filetime - FILETIME_UNIX_EPOCH) + utcOffsetMs * 10000;
+    qint64 dayTicks = ((ticks % TICKS_PER_DAY) + TICKS_PER_DAY) % TICKS_PER_DAY;
+
+    int secs = (int)(dayTicks / 10000000);
+    int fraction = (int)(dayTicks % 10000000);
+    int hour = secs / 3600;
+
+    return QString().sprintf("%d:%02d:%02d.%07d %s",
+            hour % 12 ? hour % 12 : 12, secs / 60 % 60, secs % 60, fraction,
+            hour < 12 ? "AM" : "PM").toAscii();
+}
+
+QByteArray PmlReader::operationName(quint32 eventClass, quint16 operation) const
+{
+    const char **names = NULL;
+    size_t count = 0;
+
+    switch (eventClass) {
+        case ProcessClass:    names = processOpers;    count = COUNT_OF(processOpers);    break;
+        case RegistryClass:   names = registryOpers;   count = COUNT_OF(registryOpers);   break;
+        case FileSystemClass: names = fileSystemOpers; count = COUNT_OF(fileSystemOpers); break;
+        case ProfilingClass:  names = profilingOpers;  count = COUNT_OF(profilingOpers);  break;
+        case NetworkClass:    names = networkOpers;    count = COUNT_OF(networkOpers);    break;
+    }
+
+    if (operation < count)
+        return names[operation];
+
+    return QString("Operation %1-%2").arg(eventClass).arg(operation).toAscii();
+}
+
+static QByteArray hostAndPort(const uchar *addr, bool ipv4, quint16 port)
+{
+    QString host;
+    if (ipv4) {
+        host = QString("%1.%2.%3.%4").arg(addr[0]).arg(addr[1]).arg(addr[2]).arg(addr[3]);
+    } else {
+        QStringList words;
+        for (int i=0; i<16; i+=2)
+            words.append(QString::number((addr[i] << 8) | addr[i+1], 16));
+        host = words.join(":");
+    }
+
+    return QString("%1:%2").arg(host).arg(port).toAscii();
+}
+
+QByteArray PmlReader::eventPath(const PmlBytes &event, quint32 eventClass, quint16 operation, quint64 details,
+        quint64 detailsEnd, QByteArray &operName) const
+{
+    quint64 pos = details;
+
+    switch (eventClass) {
+        case FileSystemClass:
+        {
+            // sub-operation and padding, then the IRP parameters
+            pos += 4 + ptrSize*5 + 0x14;
+            quint16 info = event.u16(pos);
+            pos += 4;
+            return pos <= detailsEnd ? detailString(event, pos, info) : QByteArray();
+        }
+
+        case RegistryClass:
+        {
+            quint16 info = event.u16(pos);
+            pos += 2;
+
+            // what comes between the length of the key and the key itself
+            switch (operation) {
+                case RegLoadKeyOper:
+                case RegRenameKeyOper:  pos += 2; break;
+                case RegOpenKeyOper:
+                case RegCreateKeyOper:  pos += 2 + 4; break;
+                case RegQueryKeyOper:
+                case RegQueryValueOper: pos += 2 + 4 + 4; break;
+                case RegEnumValueOper:
+                case RegEnumKeyOper:    pos += 2 + 4 + 4 + 4; break;
+                case RegSetInfoKeyOper: pos += 2 + 4 + 4 + 2 + 2; break;
+                case RegSetValueOper:   pos += 2 + 4 + 4 + 2 + 2; break;
+            }
+
+            QByteArray path = pos <= detailsEnd ? detailString(event, pos, info) : QByteArray();
+
+            // the names procmon shows for the registry roots
+            if (path.startsWith("\\REGISTRY\\MACHINE"))
+                path.replace(0, 17, "HKLM");
+            else if (path.startsWith("\\REGISTRY\\USER"))
+                path.replace(0, 14, "HKU");
+
+            return path;
+        }
+
+        case ProcessClass:
+        {
+            if (operation != LoadImageOper)
+                return QByteArray();
+
+            // image base and size, then the image path
+            pos += ptrSize + 4;
+            quint16 info = event.u16(pos);
+            pos += 4;
+            return pos <= detailsEnd ? detailString(event, pos, info) : QByteArray();
+        }
+
+        case NetworkClass:
+        {
+            quint16 flags = event.u16(pos);
+            operName = ((flags & 4) ? "TCP " : "UDP ") + operName;
+
+            // flags, padding, packet length, two addresses and two ports
+            if (!event.has(pos, 4 + 4 + 16 + 16 + 4) || pos + 4 + 4 + 16 + 16 + 4 > detailsEnd)
+                return QByteArray();
+
+            const uchar *src = event.at(pos + 8);
+            const uchar *dst = event.at(pos + 24);
+            quint16 srcPort = event.u16(pos + 40);
+            quint16 dstPort = event.u16(pos + 42);
+
+            return hostAndPort(src, flags & 1, srcPort) + " -> " + hostAndPort(dst, flags & 2, dstPort);
+        }
+    }
+
+    return QByteArray();
+}
+
+QByteArray PmlReader::resultName(quint32 result)
+{
+    switch (result) {
+        case 0x00000000: return "SUCCESS";
+        case 0x00000103: return "PENDING";
+        case 0x00000104: return "REPARSE";
+        case 0x80000005: return "BUFFER OVERFLOW";
+        case 0x80000006: return "NO MORE FILES";
+        case 0x8000001a: return "NO MORE ENTRIES";
+        case 0xc0000008: return "INVALID HANDLE";
+        case 0xc000000d: return "INVALID PARAMETER";
+        case 0xc0000010: return "INVALID DEVICE REQUEST";
+        case 0xc0000011: return "END OF FILE";
+        case 0xc0000022: return "ACCESS DENIED";
+        case 0xc0000023: return "BUFFER TOO SMALL";
+        case 0xc0000034: return "NAME NOT FOUND";
+        case 0xc0000035: return "NAME COLLISION";
+        case 0xc000003a: return "PATH NOT FOUND";
+        case 0xc0000043: return "SHARING VIOLATION";
+        case 0xc0000056: return "DELETE PENDING";
+        case 0xc00000ba: return "IS DIRECTORY";
+        case 0xc00000bb: return "NOT SUPPORTED";
+        case 0xc0000101: return "DIRECTORY NOT EMPTY";
+        case 0xc0000103: return "NOT A DIRECTORY";
+        case 0xc0000225: return "NOT FOUND";
+        case 0xc01c0004: return "FAST IO DISALLOWED";
+    }
+
+    return QString().sprintf("0x%08X", result).toAscii();
+}
+
+static QByteArray quoted(const QByteArray &value)
+{
+    QByteArray field = value;
+    field.replace('"', "\"\"").replace('\r', ' ').replace('\n', ' ');
+    return '"' + field + '"';
+}
+
+QByteArray PmlReader::header() const
+{
+    return "\"Time of Day\",\"Process Name\",\"PID\",\"Operation\",\"Path\",\"Result\",\"Detail\",\"TID\"\r\n";
+}
+
+bool PmlReader::eventLine(int index, QByteArray &line) const
+{
+    if (index < 0 || index >= (int)numEvents)
+        return false;
+
+    quint64 offset = offsets.u32(offsets.start + (quint64)index * EVENT_OFFSET_SIZE);
+
+    // an event cut short at the end of the capture is skipped
+    PmlBytes event;
+    if (!read(offset, EV_HEADER_SIZE, event))
+        return false;
+
+    quint64 details = offset + EV_HEADER_SIZE + (quint64)event.u16(offset + EV_STACK_DEPTH) * ptrSize;
+    quint64 detailsEnd = details + event.u32(offset + EV_DETAILS_LEN);
+    if (!read(offset, detailsEnd - offset, event))
+        return false;
+
+    quint32 eventClass = event.u32(offset + EV_CLASS);
+    quint16 operation = event.u16(offset + EV_OPERATION);
+
+    PmlProcess process = processes.value(event.u32(offset + EV_PROCESS));
+
+    QByteArray operName = operationName(eventClass, operation);
+    QByteArray path = eventPath(event, eventClass, operation, details, detailsEnd, operName);
+
+    line = quoted(timeOfDay(event.u64(offset + EV_DATE))) + ',' +
+           quoted(process.name) + ',' +
+           quoted(QByteArray::number(process.pid)) + ',' +
+           quoted(operName) + ',' +
+           quoted(path) + ',' +
+           quoted(resultName(event.u32(offset + EV_RESULT))) + ',' +
+           quoted(QByteArray()) + ',' +
+           quoted(QByteArray::number(event.u32(offset + EV_TID))) + "\r\n";
+    return true;
+}
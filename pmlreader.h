@@ -0,0 +1,93 @@
+#ifndef PMLREADER_H
+#define PMLREADER_H
+
+#include <QByteArray>
+#include <QFile>
+#include <QHash>
+#include <QMutex>
+#include <QString>
+
+// Reads the events of a ProcMon PML capture straight from the file and
+// turns each one into a line like those of a CSV export:
+//
+//   "Time of Day","Process Name","PID","Operation","Path","Result","Detail","TID"
+//
+// Only what the comparison needs is decoded. Operations are named after
+// their main class (no file system sub-operations), the Detail column is
+// left empty, and results without a well-known name are shown as hex
+// status codes.
+//
+// Events are read by their number, so any of them can be turned back into
+// its line later. The capture is read a window at a time, so captures of
+// any size can be read in a 32-bit address space, and reading the events in
+// order mostly stays within the window. Once open, a reader can be used
+// from several threads.
+class PmlReader
+{
+public:
+    PmlReader(const QString &fname);
+
+    static bool isPml(const QString &fname);
+
+    bool open(QString &error);
+
+    int eventCount() const { return numEvents; }
+
+    QByteArray header() const;
+    bool eventLine(int index, QByteArray &line) const; // false for events cut short
+
+private:
+    struct PmlProcess {
+        PmlProcess(): pid(0) { }
+
+        quint32 pid;
+        QByteArray name;
+    };
+
+    // bytes of the capture read into memory, addressed by their offset in the file
+    struct PmlBytes {
+        PmlBytes(): start(0) { }
+
+        bool has(quint64 offset, quint64 len) const {
+            return offset >= start && offset - start <= (quint64)bytes.size() &&
+                   len <= (quint64)bytes.size() - (offset - start);
+        }
+        const uchar *at(quint64 offset) const { return (const uchar *)bytes.constData() + (offset - start); }
+
+        quint16 u16(quint64 offset) const;
+        quint32 u32(quint64 offset) const;
+        quint64 u64(quint64 offset) const;
+
+        quint64 start;
+        QByteArray bytes;
+    };
+
+    bool read(quint64 offset, quint64 len, PmlBytes &bytes) const;
+
+    QByteArray tableString(quint32 index) const;
+    QByteArray detailString(const PmlBytes &bytes, quint64 &offset, quint16 info) const;
+    QByteArray timeOfDay(quint64 filetime) const;
+    QByteArray operationName(quint32 eventClass, quint16 operation) const;
+    QByteArray eventPath(const PmlBytes &event, quint32 eventClass, quint16 operation, quint64 details,
+            quint64 detailsEnd, QByteArray &operName) const;
+    static QByteArray resultName(quint32 result);
+
+    mutable QFile file;
+    qint64 size;
+
+    // the part of the capture last read, shared by the threads reading it
+    mutable QMutex mutex;
+    mutable PmlBytes window;
+
+    PmlBytes offsets; // the event offsets array
+
+    bool is64;
+    int ptrSize;
+    quint32 numEvents;
+    quint64 stringTable;
+    qint64 utcOffsetMs; // local time of the capture
+
+    QHash<quint32, PmlProcess> processes; // by process index
+};
+
+#endif // PMLREADER_H
@@ -0,0 +1,224 @@
+#include "reportexport.h"
+
+#include "patiencediff.h"
+
+// lines of context around each change, as in diff -u
+#define CONTEXT_LINES 3
+
+void ReportWriter::put(int index, const QByteArray &text, bool ok, int removals, int additions)
+{
+    QMutexLocker locker(&mutex);
+
+    if (!ok)
+        failed = true;
+    else if (!canceled)
+        diffCounts[index] = qMakePair(removals, additions);
+
+    pending[index] = text;
+
+    while (!pending.isEmpty() && pending.constBegin().key() == next) {
+        QByteArray data = pending.take(next);
+        if (out->write(data) != data.size())
+            failed = true;
+        next++;
+    }
+}
+
+bool ReportWriter::counts(int index, int &removals, int &additions)
+{
+    QMutexLocker locker(&mutex);
+
+    if (!diffCounts.contains(index))
+        return false;
+
+    removals = diffCounts[index].first;
+    additions = diffCounts[index].second;
+    return true;
+}
+
+int ReportWriter::written()
+{
+    QMutexLocker locker(&mutex);
+    return next;
+}
+
+bool ReportWriter::hasFailed()
+{
+    QMutexLocker locker(&mutex);
+    return failed;
+}
+
+void ReportWriter::cancel()
+{
+    QMutexLocker locker(&mutex);
+    canceled = true;
+}
+
+bool ReportWriter::isCanceled()
+{
+    QMutexLocker locker(&mutex);
+    return canceled;
+}
+
+// a stretch of lines that differ, between two runs of common lines
+struct DiffBlock {
+    DiffBlock(int a0=0, int a1=0, int b0=0, int b1=0):
+        a0(a0), a1(a1), b0(b0), b1(b1) { }
+
+    int a0, a1;
+    int b0, b1;
+};
+
+static void appendLine(QByteArray &text, char prefix, const QByteArray &line)
+{
+    int len = line.size();
+    while (len > 0 && (line.at(len-1) == '\n' || line.at(len-1) == '\r'))
+        len--;
+
+    text += prefix;
+    text += line.left(len);
+    text += '\n';
+}
+
+static QString hunkRange(int start, int count)
+{
+    // an empty range is given by the line before it
+    return QString("%1,%2").arg(count ? start+1 : start).arg(count);
+}
+
+bool ReportTask::diffSlice(int from1, int to1, int from2, int to2, QByteArray &text, int &removals, int &additions)
+{
+    QVector<quint64> seq1;
+    QVector<quint64> seq2;
+
+    if (!store->sequence(0, match.id1, seqKey, seq1, from1, to1) ||
+        !store->sequence(1, match.id2, seqKey, seq2, from2, to2))
+        return false;
+
+    QVector<Anchor> common;
+    patienceAlign(seq1, seq2, common);
+
+    removals += seq1.size() - common.size();
+    additions += seq2.size() - common.size();
+
+    // the changes are the gaps in the alignment
+
+    QVector<DiffBlock> blocks;
+    int i1 = 0;
+    int i2 = 0;
+    for (int k=0; k<=common.size(); k++) {
+        int c1 = k < common.size() ? common.at(k).first : seq1.size();
+        int c2 = k < common.size() ? common.at(k).second : seq2.size();
+
+        if (c1 > i1 || c2 > i2)
+            blocks.append(DiffBlock(i1, c1, i2, c2));
+
+        i1 = c1+1;
+        i2 = c2+1;
+    }
+
+    if (blocks.isEmpty())
+        return true; // like diff, nothing for identical threads
+
+    if (text.isEmpty()) {
+        text += QString("--- 0-%1\n").arg(match.id1).toAscii();
+        text += QString("+++ 1-%1\n").arg(match.id2).toAscii();
+    }
+
+    // changes closer than twice the context go into one hunk
+
+    for (int first=0; first<blocks.size(); ) {
+        int last = first;
+        while (last+1 < blocks.size() && blocks.at(last+1).a0 - blocks.at(last).a1 <= 2*CONTEXT_LINES)
+            last++;
+
+        const DiffBlock &fb = blocks.at(first);
+        const DiffBlock &lb = blocks.at(last);
+
+        // the lines around the changes are common, so both sides have as many
+        int before = qMin(CONTEXT_LINES, fb.a0);
+        int after = qMin(CONTEXT_LINES, seq1.size() - lb.a1);
+
+        int start1 = fb.a0 - before;
+        int start2 = fb.b0 - before;
+        int end1 = lb.a1 + after;
+        int end2 = lb.b1 + after;
+
+        // only the raw lines of the hunk are read
+        QList<QByteArray> lines1;
+        QList<QByteArray> lines2;
+        if (!store->rawLines(0, match.id1, lines1, from1 + start1, from1 + end1) ||
+            !store->rawLines(1, match.id2, lines2, from2 + start2, from2 + end2) ||
+            lines1.size() != end1 - start1 || lines2.size() != end2 - start2)
+            return false;
+
+        // line numbers are those of the whole thread
+        text += QString("@@ -%1 +%2 @@\n")
+                .arg(hunkRange(from1 + start1, end1-start1))
+                .arg(hunkRange(from2 + start2, end2-start2)).toAscii();
+
+        int pos1 = start1;
+        for (int b=first; b<=last; b++) {
+            const DiffBlock &block = blocks.at(b);
+
+            for (; pos1<block.a0; pos1++)
+                appendLine(text, ' ', lines1.at(pos1 - start1));
+            for (int i=block.a0; i<block.a1; i++)
+                appendLine(text, '-', lines1.at(i - start1));
+            for (int i=block.b0; i<block.b1; i++)
+                appendLine(text, '+', lines2.at(i - start2));
+
+            pos1 = block.a1;
+        }
+        for (; pos1<end1; pos1++)
+            appendLine(text, ' ', lines1.at(pos1 - start1));
+
+        first = last+1;
+    }
+
+    return true;
+}
+
+void ReportTask::run()
+{
+    if (writer->isCanceled()) {
+        writer->put(index, QByteArray());
+        return;
+    }
+
+    int from1, to1, from2, to2;
+    if (!store->windowRows(0, match.id1, window1, from1, to1) ||
+        !store->windowRows(1, match.id2, window2, from2, to2)) {
+        writer->put(index, QByteArray(), false);
+        return;
+    }
+
+    int rows1 = to1 - from1;
+    int rows2 = to2 - from2;
+
+    // an external store only lets us have the threads within the budget. a
+    // pair that doesn't fit is diffed in the slices the matching diffs it
+    // in, so the hunks break where its counts do
+    MemoryBudget *budget = store->memoryBudget();
+    qint64 reserved = 0;
+    int slices = 1;
+    if (budget) {
+        qint64 cost = (qint64)(rows1 + rows2) * SEQ_BYTES_PER_ROW;
+        reserved = budget->acquire(cost);
+        slices = qMax(1, (int)((cost + reserved - 1) / reserved));
+    }
+
+    QByteArray text;
+    int removals = 0;
+    int additions = 0;
+    bool ok = true;
+    for (int i=0; ok && i<slices && !writer->isCanceled(); i++)
+        ok = diffSlice(from1 + (int)((qint64)rows1*i/slices), from1 + (int)((qint64)rows1*(i+1)/slices),
+                       from2 + (int)((qint64)rows2*i/slices), from2 + (int)((qint64)rows2*(i+1)/slices),
+                       text, removals, additions);
+
+    if (budget)
+        budget->release(reserved);
+
+    writer->put(index, text, ok, removals, additions);
+}
@@ -0,0 +1,70 @@
+#ifndef REPORTEXPORT_H
+#define REPORTEXPORT_H
+
+#include <QHash>
+#include <QIODevice>
+#include <QMap>
+#include <QPair>
+#include <QMutex>
+#include <QRunnable>
+
+#include "logdiff.h"
+
+// Collects the diffs of a report as tasks finish them, and writes them out
+// in report order as soon as all earlier ones are in. Only the diffs that
+// finished ahead of their turn are held in memory.
+class ReportWriter
+{
+public:
+    ReportWriter(QIODevice *out):
+        out(out), next(0), failed(false), canceled(false) { }
+
+    void put(int index, const QByteArray &text, bool ok=true, int removals=0, int additions=0);
+
+    // the lines the diff of a pair removed and added, false if it wasn't diffed
+    bool counts(int index, int &removals, int &additions);
+
+    int written();
+    bool hasFailed();
+
+    void cancel();
+    bool isCanceled();
+
+private:
+    QMutex mutex;
+    QIODevice *out;
+    QMap<int, QByteArray> pending;
+    QHash<int, QPair<int, int> > diffCounts;
+    int next;
+    bool failed;
+    bool canceled;
+};
+
+// Unified diff of one matched thread pair, aligned on the sequences the
+// matching compared, but showing the raw lines. Only the events in the time
+// windows are compared, and within a memory budget a pair is diffed in the
+// same slices as the matching diffs it in.
+class ReportTask: public QRunnable
+{
+public:
+    ReportTask(const TraceStore *store, TraceStore::SeqKey seqKey, int index, const Match &match,
+            const TimeWindow &window1, const TimeWindow &window2, ReportWriter *writer):
+        QRunnable(),
+        store(store), seqKey(seqKey), index(index), match(match),
+        window1(window1), window2(window2), writer(writer) { }
+
+    void run();
+
+private:
+    bool diffSlice(int from1, int to1, int from2, int to2, QByteArray &text, int &removals, int &additions);
+
+    const TraceStore *store;
+    TraceStore::SeqKey seqKey;
+    int index;
+    Match match;
+    TimeWindow window1;
+    TimeWindow window2;
+    ReportWriter *writer;
+};
+
+#endif // REPORTEXPORT_H
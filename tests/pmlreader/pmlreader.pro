@@ -0,0 +1,24 @@
+#-------------------------------------------------
+#
+# PmlReader tests: a built-in capture, and the sample
+# captures in samples/ against their ProcMon CSV exports
+#
+#-------------------------------------------------
+
+QT       += core testlib
+QT       -= gui
+
+TARGET = tst_pmlreader
+CONFIG   += console testcase
+CONFIG   -= app_bundle
+
+TEMPLATE = app
+
+INCLUDEPATH += ../..
+
+DEFINES += SAMPLES_DIR=\\\"$$PWD/samples\\\"
+
+SOURCES += tst_pmlreader.cpp\
+        ../../pmlreader.cpp
+
+HEADERS  += ../../pmlreader.h
@@ -0,0 +1,316 @@
+#include <QtTest>
+
+#include <QDateTime>
+#include <QDir>
+#include <QTemporaryFile>
+#include <QtEndian>
+
+#include "pmlreader.h"
+
+#if QT_VERSION >= 0x050000
+#define SKIP(message) QSKIP(message)
+#else
+#define SKIP(message) QSKIP(message, SkipAll)
+#endif
+
+// where the built-in capture puts its tables
+#define STRING_TABLE  0x400
+#define PROCESS_TABLE 0x500
+#define EVENT_OFFSETS 0x600
+#define EVENTS        0x700
+
+#define FILETIME_UNIX_EPOCH Q_UINT64_C(116444736000000000)
+
+// A small 32-bit PML capture written field by field, laid out as ProcMon
+// lays out its files
+class CaptureBuilder
+{
+public:
+    CaptureBuilder(): data(EVENTS, '\0'), numEvents(0), eventEnd(EVENTS) { }
+
+    void put16(int offset, quint16 value) { reserve(offset+2); qToLittleEndian(value, at(offset)); }
+    void put32(int offset, quint32 value) { reserve(offset+4); qToLittleEndian(value, at(offset)); }
+    void put64(int offset, quint64 value) { reserve(offset+8); qToLittleEndian(value, at(offset)); }
+
+    void putBytes(int offset, const QByteArray &bytes)
+    {
+        reserve(offset + bytes.size());
+        data.replace(offset, bytes.size(), bytes);
+    }
+
+    static QByteArray utf16(const QString &text)
+    {
+        QByteArray bytes;
+        foreach (QChar ch, text) {
+            bytes += (char)(ch.unicode() & 0xff);
+            bytes += (char)(ch.unicode() >> 8);
+        }
+        return bytes;
+    }
+
+    void strings(const QStringList &strings)
+    {
+        put32(STRING_TABLE, strings.size());
+
+        int pos = STRING_TABLE + 4 + strings.size()*4;
+        for (int i=0; i<strings.size(); i++) {
+            QByteArray bytes = utf16(strings.at(i));
+            put32(STRING_TABLE + 4 + i*4, pos - STRING_TABLE);
+            put32(pos, bytes.size());
+            putBytes(pos + 4, bytes);
+            pos += 4 + bytes.size();
+        }
+    }
+
+    // process index, pid and the string index of its name
+    void processes(const QList<QList<quint32> > &processes)
+    {
+        int n = processes.size();
+        put32(PROCESS_TABLE, n);
+
+        int pos = PROCESS_TABLE + 4 + n*8;
+        for (int i=0; i<n; i++) {
+            put32(PROCESS_TABLE + 4 + i*4, processes.at(i).at(0));
+            put32(PROCESS_TABLE + 4 + n*4 + i*4, pos - PROCESS_TABLE);
+
+            put32(pos + 0, processes.at(i).at(0));
+            put32(pos + 4, processes.at(i).at(1));
+            put32(pos + 64, processes.at(i).at(2));
+            pos += 68;
+        }
+    }
+
+    void event(quint32 process, quint32 tid, quint32 eventClass, quint16 operation, quint64 filetime,
+            quint32 result, int stackDepth, const QByteArray &details)
+    {
+        int event = eventEnd;
+        put32(event + 0, process);
+        put32(event + 4, tid);
+        put32(event + 8, eventClass);
+        put16(event + 12, operation);
+        put64(event + 28, filetime);
+        put32(event + 36, result);
+        put16(event + 40, stackDepth);
+        put32(event + 44, details.size());
+        putBytes(event + 52 + stackDepth*4, details);
+
+        eventOffset(event);
+        eventEnd = event + 52 + stackDepth*4 + details.size();
+    }
+
+    void eventOffset(quint32 offset)
+    {
+        put32(EVENT_OFFSETS + numEvents*5, offset);
+        numEvents++;
+    }
+
+    bool write(QTemporaryFile &file)
+    {
+        putBytes(0, "PML_");
+        put32(4, 9);
+        put32(0x008, 0);
+        put32(0x234, numEvents);
+        put64(0x248, EVENT_OFFSETS);
+        put64(0x250, PROCESS_TABLE);
+        put64(0x258, STRING_TABLE);
+
+        return file.open() && file.write(data) == data.size() && file.flush();
+    }
+
+private:
+    void reserve(int size) { if (data.size() < size) data.append(QByteArray(size - data.size(), '\0')); }
+    uchar *at(int offset) { return (uchar *)data.data() + offset; }
+
+    QByteArray data;
+    int numEvents;
+    int eventEnd;
+};
+
+// the fields of a CSV line, unquoted
+static QStringList csvFields(const QByteArray &line)
+{
+    QString text = QString::fromUtf8(line.trimmed());
+    QStringList fields;
+    QString field;
+    bool quoted = false;
+
+    for (int i=0; i<text.size(); i++) {
+        QChar ch = text.at(i);
+        if (quoted && ch == '"' && i+1 < text.size() && text.at(i+1) == '"') {
+            field += '"';
+            i++;
+        } else if (ch == '"') {
+            quoted = !quoted;
+        } else if (ch == ',' && !quoted) {
+            fields.append(field);
+            field.clear();
+        } else {
+            field += ch;
+        }
+    }
+    fields.append(field);
+
+    return fields;
+}
+
+class TestPmlReader: public QObject
+{
+    Q_OBJECT
+
+private slots:
+    void builtInCapture();
+    void sampleCaptures();
+
+private:
+    void compareSample(const QString &pmlFname, const QString &csvFname);
+};
+
+void TestPmlReader::builtInCapture()
+{
+    // the time procmon would show for the events, in local time
+    qint64 ms = Q_INT64_C(1500000000123);
+    quint64 filetime = FILETIME_UNIX_EPOCH + (quint64)ms * 10000 + 4567;
+
+    QTime local = QDateTime::fromMSecsSinceEpoch(ms).time();
+    QByteArray time = QString().sprintf("%d:%02d:%02d.%07d %s",
+            local.hour() % 12 ? local.hour() % 12 : 12, local.minute(), local.second(),
+            local.msec() * 10000 + 4567, local.hour() < 12 ? "AM" : "PM").toAscii();
+
+    CaptureBuilder builder;
+    builder.strings(QStringList() << "Explorer.EXE" << "svchost.exe");
+    builder.processes(QList<QList<quint32> >()
+            << (QList<quint32>() << 7 << 1234 << 0)
+            << (QList<quint32>() << 9 << 88 << 1));
+
+    // RegOpenKey, with an ASCII key
+    QByteArray key = "\\REGISTRY\\MACHINE\\Software";
+    QByteArray regDetails(2 + 2 + 4, '\0');
+    qToLittleEndian((quint16)(0x8000 | key.size()), (uchar *)regDetails.data());
+    builder.event(7, 100, 2, 0, filetime, 0, 0, regDetails + key);
+
+    // CreateFile, with a stack and a UTF-16 path
+    QString path = "C:\\Windows\\win.ini";
+    QByteArray fileDetails(4 + 4*5 + 0x14 + 4, '\0');
+    qToLittleEndian((quint16)path.size(), (uchar *)fileDetails.data() + 4 + 4*5 + 0x14);
+    builder.event(9, 200, 3, 20, filetime, 0xc0000034, 2, fileDetails + CaptureBuilder::utf16(path));
+
+    // Thread Create, with a result that has no name
+    builder.event(7, 100, 1, 3, filetime, 0xdeadbeef, 0, QByteArray());
+
+    // and an event past the end of the capture
+    builder.eventOffset(0x7fffffff);
+
+    QTemporaryFile file;
+    QVERIFY(builder.write(file));
+
+    QVERIFY(PmlReader::isPml(file.fileName()));
+
+    PmlReader reader(file.fileName());
+    QString error;
+    QVERIFY2(reader.open(error), qPrintable(error));
+    QCOMPARE(reader.eventCount(), 4);
+
+    QByteArray line;
+
+    QVERIFY(reader.eventLine(0, line));
+    QCOMPARE(line, "\"" + time + "\",\"Explorer.EXE\",\"1234\",\"RegOpenKey\",\"HKLM\\Software\",\"SUCCESS\",\"\",\"100\"\r\n");
+
+    QVERIFY(reader.eventLine(1, line));
+    QCOMPARE(line, "\"" + time + "\",\"svchost.exe\",\"88\",\"CreateFile\",\"C:\\Windows\\win.ini\",\"NAME NOT FOUND\",\"\",\"200\"\r\n");
+
+    QVERIFY(reader.eventLine(2, line));
+    QCOMPARE(line, "\"" + time + "\",\"Explorer.EXE\",\"1234\",\"Thread Create\",\"\",\"0xDEADBEEF\",\"\",\"100\"\r\n");
+
+    QVERIFY(!reader.eventLine(3, line));
+    QVERIFY(!reader.eventLine(4, line));
+
+    // the header names the columns the way a CSV export does
+    QStringList columns = csvFields(reader.header());
+    QCOMPARE(columns, QStringList() << "Time of Day" << "Process Name" << "PID" << "Operation"
+            << "Path" << "Result" << "Detail" << "TID");
+}
+
+void TestPmlReader::sampleCaptures()
+{
+    QDir samples(SAMPLES_DIR);
+    QStringList captures = samples.entryList(QStringList() << "*.pml", QDir::Files);
+    if (captures.isEmpty())
+        SKIP("No sample captures in " SAMPLES_DIR);
+
+    foreach (QString capture, captures) {
+        QString csvFname = samples.filePath(QFileInfo(capture).completeBaseName() + ".csv");
+        QVERIFY2(QFile::exists(csvFname), qPrintable(QString("No CSV export next to %1").arg(capture)));
+
+        compareSample(samples.filePath(capture), csvFname);
+    }
+}
+
+void TestPmlReader::compareSample(const QString &pmlFname, const QString &csvFname)
+{
+    PmlReader reader(pmlFname);
+    QString error;
+    QVERIFY2(reader.open(error), qPrintable(error));
+
+    QFile csvFile(csvFname);
+    QVERIFY(csvFile.open(QFile::ReadOnly));
+
+    QByteArray header = csvFile.readLine();
+    if (header.startsWith("\xef\xbb\xbf"))
+        header.remove(0, 3);
+
+    // the columns of the export, by name
+    QStringList names = csvFields(header);
+    QStringList readerNames = csvFields(reader.header());
+
+    // file system operations with sub-operations, which the reader doesn't name
+    QStringList mainOperations = QStringList() << "QueryInformationFile" << "SetInformationFile"
+            << "QueryVolumeInformation" << "SetVolumeInformation" << "DirectoryControl"
+            << "FileSystemControl" << "DeviceIoControl" << "LockUnlockFile" << "CreateFileMapping"
+            << "QuerySecurityFile" << "SetSecurityFile" << "PlugAndPlay";
+
+    int event = 0;
+    for (int row=1; ; row++) {
+        QByteArray csvLine = csvFile.readLine();
+        if (csvLine.isEmpty())
+            break;
+
+        QByteArray line;
+        while (event < reader.eventCount() && !reader.eventLine(event, line))
+            event++;
+        QVERIFY2(event < reader.eventCount(), qPrintable(QString("%1 has more rows than %2 has events")
+                .arg(csvFname).arg(pmlFname)));
+        event++;
+
+        QStringList expected = csvFields(csvLine);
+        QStringList actual = csvFields(line);
+
+        foreach (QString name, readerNames) {
+            int expectedCol = names.indexOf(name);
+            if (expectedCol < 0 || name == "Detail")
+                continue;
+
+            QString want = expected.value(expectedCol);
+            QString got = actual.value(readerNames.indexOf(name));
+
+            // what the reader leaves undecoded
+            if (name == "Operation" && mainOperations.contains(got))
+                continue;
+            if (name == "Result" && got.startsWith("0x"))
+                continue;
+
+            if (got != want)
+                QFAIL(qPrintable(QString("%1 row %2, %3: \"%4\" in the export, \"%5\" read")
+                        .arg(csvFname).arg(row).arg(name).arg(want).arg(got)));
+        }
+    }
+
+    while (event < reader.eventCount()) {
+        QByteArray line;
+        QVERIFY2(!reader.eventLine(event++, line), qPrintable(QString("%1 has more events than %2 has rows")
+                .arg(pmlFname).arg(csvFname)));
+    }
+}
+
+QTEST_APPLESS_MAIN(TestPmlReader)
+
+#include "tst_pmlreader.moc"
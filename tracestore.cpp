@@ -0,0 +1,585 @@
+#include "tracestore.h"
+
+#include <QDataStream>
+#include <QDir>
+#include <QFile>
+
+#include <string.h>
+
+#include "patiencediff.h"
+#include "pmlreader.h"
+
+#define MAX_LINE_LEN 2048
+
+// records read from a run file at a time
+#define RUN_BATCH 4096
+
+// rough size of a memoized path hash, with the hash table overhead
+#define NORM_MEMO_ENTRY_BYTES 128
+
+static const char *columnNames[TraceStore::ColumnCount] = {
+    "Process Name",
+    "Operation",
+    "Result",
+    "Path"
+};
+
+MemoryBudget::MemoryBudget(qint64 bytes):
+    kbytes((int)qBound(Q_INT64_C(1), bytes >> 10, Q_INT64_C(0x7fffffff))),
+    limit(kbytes.available())
+{
+}
+
+qint64 MemoryBudget::acquire(qint64 bytes)
+{
+    int n = (int)qBound(Q_INT64_C(1), (bytes + 1023) >> 10, (qint64)limit);
+    kbytes.acquire(n);
+    return (qint64)n << 10;
+}
+
+void MemoryBudget::release(qint64 reserved)
+{
+    kbytes.release((int)(reserved >> 10));
+}
+
+TraceStore::TraceStore():
+    numbers(NUMBERS_PATTERN, Qt::CaseInsensitive),
+    budget(NULL),
+    bufferLimit(0),
+    buffered(0),
+    normMemoLimit(0)
+{
+}
+
+TraceStore::~TraceStore()
+{
+    delete budget;
+}
+
+void TraceStore::clear()
+{
+    for (int col=0; col<ColumnCount; col++) {
+        dicts[col] = TraceDict();
+        normMemo[col].clear();
+    }
+
+    logs.clear();
+    buffered = 0;
+}
+
+void TraceStore::clearLog(int logNo)
+{
+    if (logNo >= logs.size())
+        return;
+
+    // records still buffered for the log are dropped with it
+    foreach (const TraceThread &thread, logs.at(logNo).threads)
+        buffered -= thread.buffer.size();
+
+    logs[logNo] = TraceLog();
+
+    // logs no longer loaded at the end don't keep a slot either
+    while (!logs.isEmpty() && logs.last().fname.isEmpty())
+        logs.pop_back();
+}
+
+void TraceStore::setBudget(qint64 bytes, const QString &runDir)
+{
+    delete budget;
+    budget = NULL;
+
+    this->runDir = runDir;
+
+    if (bytes <= 0)
+        return;
+
+    // a quarter for the spill buffers, an eighth for memoized operation
+    // and path hashes, and half for the sequences being compared
+    bufferLimit = bytes / 4;
+    normMemoLimit = qMax(1024, (int)qMin(bytes / 8 / 2 / NORM_MEMO_ENTRY_BYTES, Q_INT64_C(0x7fffffff)));
+    budget = new MemoryBudget(bytes / 2);
+}
+
+QString TraceStore::runFname(int logNo, const QString &id) const
+{
+    return QDir(runDir).filePath(QString("%1-%2.run").arg(logNo).arg(id));
+}
+
+void TraceStore::beginLog(int logNo, const QString &fname, const QByteArray &header,
+        const QSharedPointer<PmlReader> &pml)
+{
+    if (logs.size() <= logNo)
+        logs.resize(logNo+1);
+
+    TraceLog &log = logs[logNo];
+    log = TraceLog();
+    log.fname = fname;
+    log.pml = pml;
+
+    QList<QByteArray> names = header.trimmed().split(',');
+
+    for (int col=0; col<ColumnCount; col++) {
+        log.fieldCols[col] = -1;
+        for (int field=0; field<names.size(); field++)
+            if (names.at(field).endsWith(QByteArray("\"") + columnNames[col] + "\""))
+                log.fieldCols[col] = field;
+    }
+
+    log.timeField = -1;
+    for (int field=0; field<names.size(); field++)
+        if (names.at(field).endsWith("\"Time of Day\""))
+            log.timeField = field;
+}
+
+bool TraceStore::parseTime(const char *data, int len, quint32 &time)
+{
+    // "1:23:45.6789012 PM" as procmon writes it, or "13:23:45.6789012"
+
+    int i = 0;
+    while (i < len && (data[i] == '"' || data[i] == ' '))
+        i++;
+
+    int hms[3];
+    for (int n=0; n<3; n++) {
+        if (n > 0) {
+            if (i >= len || data[i] != ':')
+                return false;
+            i++;
+        }
+
+        int start = i;
+        hms[n] = 0;
+        while (i < len && data[i] >= '0' && data[i] <= '9' && i - start < 2)
+            hms[n] = hms[n]*10 + data[i++] - '0';
+        if (i == start)
+            return false;
+    }
+
+    // milliseconds, anything finer is dropped
+    int ms = 0;
+    if (i < len && data[i] == '.') {
+        i++;
+        for (int digits=0; i < len && data[i] >= '0' && data[i] <= '9'; digits++, i++)
+            if (digits < 3)
+                ms += (data[i] - '0') * (digits == 0 ? 100 : digits == 1 ? 10 : 1);
+    }
+
+    while (i < len && data[i] == ' ')
+        i++;
+
+    if (i+1 < len && (data[i+1] == 'M' || data[i+1] == 'm')) {
+        bool pm = data[i] == 'P' || data[i] == 'p';
+        if (!pm && data[i] != 'A' && data[i] != 'a')
+            return false;
+        if (hms[0] < 1 || hms[0] > 12)
+            return false;
+        hms[0] = hms[0] % 12 + (pm ? 12 : 0);
+    }
+
+    if (hms[0] > 23 || hms[1] > 59 || hms[2] > 59)
+        return false;
+
+    time = ((hms[0]*60 + hms[1])*60 + hms[2])*1000 + ms;
+    return true;
+}
+
+quint32 TraceStore::encode(Column col, const QByteArray &value)
+{
+    TraceDict &dict = dicts[col];
+
+    QHash<QByteArray, quint32>::const_iterator it = dict.codes.constFind(value);
+    if (it != dict.codes.constEnd())
+        return it.value();
+
+    quint32 code = dict.values.size();
+
+    QByteArray normValue = QString(value).replace(numbers, "x").toAscii();
+
+    dict.values.append(value);
+    dict.codes[value] = code;
+    dict.normHashes.append(hashLine(normValue.constData(), normValue.size()));
+
+    return code;
+}
+
+quint64 TraceStore::normHash(Column col, const QByteArray &value)
+{
+    // external stores have no dictionaries, just a bounded memo
+    QHash<QByteArray, quint64> &memo = normMemo[col];
+
+    QHash<QByteArray, quint64>::const_iterator it = memo.constFind(value);
+    if (it != memo.constEnd())
+        return it.value();
+
+    if (memo.size() >= normMemoLimit)
+        memo.clear();
+
+    QByteArray normValue = QString(value).replace(numbers, "x").toAscii();
+    quint64 hash = hashLine(normValue.constData(), normValue.size());
+
+    memo[value] = hash;
+    return hash;
+}
+
+bool TraceStore::addEvent(int logNo, const QString &id, qint64 offset, const QList<QByteArray> &fields, quint64 lineHash)
+{
+    TraceLog &log = logs[logNo];
+
+    TraceThread &thread = log.threads[id];
+    thread.count++;
+
+    thread.hashA = thread.hashA * Q_UINT64_C(1099511628211) + lineHash + 1;
+    thread.hashB = ((thread.hashB << 5) | (thread.hashB >> 59)) ^ (lineHash * Q_UINT64_C(0x9e3779b97f4a7c15));
+
+    // events without a parsable time go with the ones before them
+    if (log.timeField >= 0 && log.timeField < fields.size()) {
+        const QByteArray &timeText = fields.at(log.timeField);
+        parseTime(timeText.constData(), timeText.size(), thread.lastTime);
+    }
+    quint32 time = thread.lastTime;
+
+    if (budget) {
+        int operField = log.fieldCols[OperationColumn];
+        int pathField = log.fieldCols[PathColumn];
+
+        RunRecord record;
+        record.lineHash = lineHash;
+        record.offset = offset;
+        record.operationHash = (operField >= 0 && operField < fields.size()) ? normHash(OperationColumn, fields.at(operField)) : 0;
+        record.pathHash = (pathField >= 0 && pathField < fields.size()) ? normHash(PathColumn, fields.at(pathField)) : 0;
+        record.time = time;
+
+        thread.buffer.append((const char *)&record, sizeof(record));
+
+        buffered += sizeof(record);
+        if (buffered > bufferLimit)
+            return flush();
+
+        return true;
+    }
+
+    thread.rows.append(log.offsets.size());
+
+    log.offsets.append(offset);
+    log.lineHashes.append(lineHash);
+    if (log.timeField >= 0)
+        log.times.append(time);
+
+    for (int col=0; col<ColumnCount; col++) {
+        int field = log.fieldCols[col];
+        if (field >= 0 && field < fields.size())
+            log.codes[col].append(encode((Column)col, fields.at(field)));
+    }
+
+    return true;
+}
+
+bool TraceStore::flush()
+{
+    for (int logNo=0; logNo<logs.size(); logNo++) {
+        QHash<QString, TraceThread> &threads = logs[logNo].threads;
+
+        QHash<QString, TraceThread>::iterator it;
+        for (it = threads.begin(); it != threads.end(); ++it) {
+            if (it->buffer.isEmpty())
+                continue;
+
+            QFile runFile(runFname(logNo, it.key()));
+            if (!runFile.open(QFile::Append) || runFile.write(it->buffer) != it->buffer.size())
+                return false;
+
+            it->buffer.clear();
+        }
+    }
+
+    buffered = 0;
+    return true;
+}
+
+QString TraceStore::logFname(int logNo) const
+{
+    return logNo < logs.size() ? logs.at(logNo).fname : QString();
+}
+
+bool TraceStore::isPml(int logNo) const
+{
+    return logNo < logs.size() && !logs.at(logNo).pml.isNull();
+}
+
+int TraceStore::rowCount(int logNo, const QString &id) const
+{
+    if (logNo >= logs.size())
+        return 0;
+
+    return logs.at(logNo).threads.value(id).count;
+}
+
+QByteArray TraceStore::seqHash(int logNo, const QString &id) const
+{
+    if (logNo >= logs.size())
+        return QByteArray();
+
+    TraceThread thread = logs.at(logNo).threads.value(id);
+
+    QByteArray hash;
+    QDataStream out(&hash, QIODevice::WriteOnly);
+    out << thread.hashA << thread.hashB << (quint32)thread.count;
+
+    return hash;
+}
+
+bool TraceStore::readRecords(int logNo, const QString &id, int from, int to, QVector<RunRecord> &records) const
+{
+    TraceThread thread = logs.at(logNo).threads.value(id);
+
+    if (to < 0 || to > thread.count)
+        to = thread.count;
+    if (from >= to) {
+        records.clear();
+        return true;
+    }
+
+    records.resize(to - from);
+    char *data = (char *)records.data();
+
+    // the first records are in the run file, the last ones may still be buffered
+    int spilled = thread.count - thread.buffer.size() / sizeof(RunRecord);
+    int done = 0;
+
+    if (from < spilled) {
+        done = qMin(to, spilled) - from;
+
+        QFile runFile(runFname(logNo, id));
+        qint64 bytes = (qint64)done * sizeof(RunRecord);
+        if (!runFile.open(QFile::ReadOnly) ||
+            !runFile.seek((qint64)from * sizeof(RunRecord)) ||
+            runFile.read(data, bytes) != bytes)
+            return false;
+    }
+
+    if (from + done < to)
+        memcpy(data + done * sizeof(RunRecord),
+               thread.buffer.constData() + (from + done - spilled) * sizeof(RunRecord),
+               (to - from - done) * sizeof(RunRecord));
+
+    return true;
+}
+
+bool TraceStore::threadOffsets(int logNo, const QString &id, int from, int to, QVector<qint64> &offsets) const
+{
+    offsets.clear();
+
+    if (budget) {
+        QVector<RunRecord> records;
+        if (!readRecords(logNo, id, from, to, records))
+            return false;
+
+        offsets.reserve(records.size());
+        foreach (const RunRecord &record, records)
+            offsets.append(record.offset);
+        return true;
+    }
+
+    const TraceLog &log = logs.at(logNo);
+
+    foreach (quint32 row, log.threads.value(id).rows.mid(from, to < 0 ? -1 : to - from))
+        offsets.append(log.offsets.at(row));
+
+    return true;
+}
+
+bool TraceStore::readLines(int logNo, const QVector<qint64> &offsets, QList<QByteArray> &lines) const
+{
+    const TraceLog &log = logs.at(logNo);
+
+    lines.clear();
+    lines.reserve(offsets.size());
+
+    // the lines of a capture are decoded from their events again
+    if (!log.pml.isNull()) {
+        foreach (qint64 offset, offsets) {
+            QByteArray line;
+            if (!log.pml->eventLine((int)offset, line))
+                return false;
+            lines.append(line);
+        }
+        return true;
+    }
+
+    QFile logFile(log.fname);
+    if (!logFile.open(QFile::ReadOnly))
+        return false;
+
+    foreach (qint64 offset, offsets) {
+        if (!logFile.seek(offset))
+            return false;
+        lines.append(logFile.readLine(MAX_LINE_LEN));
+    }
+
+    return true;
+}
+
+bool TraceStore::rawLine(int logNo, const QString &id, int row, QByteArray &line) const
+{
+    if (logNo >= logs.size())
+        return false;
+
+    QVector<qint64> offsets;
+    QList<QByteArray> lines;
+    if (!threadOffsets(logNo, id, row, row+1, offsets) || offsets.isEmpty() || !readLines(logNo, offsets, lines))
+        return false;
+
+    line = lines.at(0);
+    return true;
+}
+
+bool TraceStore::rawLines(int logNo, const QString &id, QList<QByteArray> &lines, int from, int to) const
+{
+    if (logNo >= logs.size())
+        return false;
+
+    QVector<qint64> offsets;
+    return threadOffsets(logNo, id, from, to, offsets) && readLines(logNo, offsets, lines);
+}
+
+bool TraceStore::writeThread(int logNo, const QString &id, const QString &fname) const
+{
+    if (logNo >= logs.size())
+        return false;
+
+    QFile threadFile(fname);
+    if (!threadFile.open(QFile::WriteOnly))
+        return false;
+
+    // a batch at a time, the thread may be larger than the memory budget
+    int count = rowCount(logNo, id);
+    for (int from=0; from<count; from+=RUN_BATCH) {
+        QVector<qint64> offsets;
+        QList<QByteArray> lines;
+        if (!threadOffsets(logNo, id, from, from+RUN_BATCH, offsets) || !readLines(logNo, offsets, lines))
+            return false;
+
+        foreach (const QByteArray &line, lines)
+            threadFile.write(line);
+    }
+
+    return true;
+}
+
+bool TraceStore::hasTimes(int logNo) const
+{
+    return logNo < logs.size() && logs.at(logNo).timeField >= 0;
+}
+
+bool TraceStore::lineTime(int logNo, const QByteArray &line, quint32 &time) const
+{
+    if (!hasTimes(logNo))
+        return false;
+
+    QList<QByteArray> fields = line.trimmed().split(',');
+    int field = logs.at(logNo).timeField;
+
+    return field < fields.size() && parseTime(fields.at(field).constData(), fields.at(field).size(), time);
+}
+
+bool TraceStore::rowTime(int logNo, const QString &id, int row, quint32 &time) const
+{
+    if (budget) {
+        QVector<RunRecord> records;
+        if (!readRecords(logNo, id, row, row+1, records) || records.isEmpty())
+            return false;
+        time = records.at(0).time;
+        return true;
+    }
+
+    const TraceLog &log = logs.at(logNo);
+
+    QHash<QString, TraceThread>::const_iterator it = log.threads.constFind(id);
+    if (it == log.threads.constEnd() || row >= it->rows.size())
+        return false;
+
+    time = log.times.at(it->rows.at(row));
+    return true;
+}
+
+bool TraceStore::firstRowAt(int logNo, const QString &id, quint32 time, int &row) const
+{
+    // the events of a thread are in time order, the log is written that way
+    int lo = 0;
+    int hi = rowCount(logNo, id);
+    while (lo < hi) {
+        int mid = (lo+hi)/2;
+
+        quint32 midTime;
+        if (!rowTime(logNo, id, mid, midTime))
+            return false;
+
+        if (midTime < time)
+            lo = mid+1;
+        else
+            hi = mid;
+    }
+
+    row = lo;
+    return true;
+}
+
+bool TraceStore::windowRows(int logNo, const QString &id, const TimeWindow &window, int &from, int &to) const
+{
+    if (window.isAll() || !hasTimes(logNo)) {
+        from = 0;
+        to = rowCount(logNo, id);
+        return true;
+    }
+
+    return firstRowAt(logNo, id, window.from, from) && firstRowAt(logNo, id, window.to, to);
+}
+
+bool TraceStore::sequence(int logNo, const QString &id, SeqKey key, QVector<quint64> &seq, int from, int to) const
+{
+    if (logNo >= logs.size())
+        return true;
+
+    const TraceLog &log = logs.at(logNo);
+
+    int count = rowCount(logNo, id);
+    if (to < 0 || to > count)
+        to = count;
+    if (from >= to)
+        return true;
+
+    seq.reserve(seq.size() + to - from);
+
+    if (budget) {
+        // streamed back from the run file, a batch at a time
+        for (int batch=from; batch<to; batch+=RUN_BATCH) {
+            QVector<RunRecord> records;
+            if (!readRecords(logNo, id, batch, qMin(batch+RUN_BATCH, to), records))
+                return false;
+
+            foreach (const RunRecord &record, records)
+                seq.append(key == LineSeq ? record.lineHash :
+                           key == OperationSeq ? record.operationHash : record.pathHash);
+        }
+        return true;
+    }
+
+    const QVector<quint32> rows = log.threads.value(id).rows.mid(from, to - from);
+
+    if (key == LineSeq) {
+        foreach (quint32 row, rows)
+            seq.append(log.lineHashes.at(row));
+        return true;
+    }
+
+    Column col = (key == OperationSeq) ? OperationColumn : PathColumn;
+
+    // a scan over a single column; the log may not have it at all
+    const QVector<quint32> &codes = log.codes[col];
+    const QVector<quint64> &normHashes = dicts[col].normHashes;
+
+    foreach (quint32 row, rows)
+        seq.append(codes.isEmpty() ? 0 : normHashes.at(codes.at(row)));
+
+    return true;
+}
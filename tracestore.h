@@ -0,0 +1,179 @@
+#ifndef TRACESTORE_H
+#define TRACESTORE_H
+
+#include <QByteArray>
+#include <QHash>
+#include <QList>
+#include <QRegExp>
+#include <QSemaphore>
+#include <QSharedPointer>
+#include <QString>
+#include <QVector>
+
+class PmlReader;
+
+// what gets edited out of lines before comparing them
+#define NUMBERS_PATTERN "0x[0-9a-f]+|[0-9][0-9]+|[0-9a-z]+-[0-9a-z]+-[0-9a-z]+-[0-9a-z]+-[0-9a-z]+|[0-9]+:[0-9]+:[0-9]+| PM| AM"
+
+// Values of one CSV column, shared by all logs so that codes compare across them
+struct TraceDict {
+    QList<QByteArray> values;
+    QHash<QByteArray, quint32> codes;
+    QVector<quint64> normHashes; // hash of each value with numbers edited out
+};
+
+// A range of times of day in ms, "from" included and "to" excluded
+struct TimeWindow {
+    enum { ALL_DAY_MS = 24*60*60*1000 };
+
+    TimeWindow(quint32 from=0, quint32 to=ALL_DAY_MS):
+        from(from), to(to) { }
+
+    bool isAll() const { return from == 0 && to >= ALL_DAY_MS; }
+
+    quint32 from;
+    quint32 to;
+};
+
+// memory a comparison needs per event: the sequence and the diff's hash tables
+#define SEQ_BYTES_PER_ROW 48
+
+// Memory that comparison tasks may use for their sequences at once.
+// Requests bigger than the whole budget get the whole budget.
+class MemoryBudget
+{
+public:
+    MemoryBudget(qint64 bytes);
+
+    qint64 acquire(qint64 bytes);
+    void release(qint64 reserved);
+
+private:
+    QSemaphore kbytes;
+    int limit;
+};
+
+// Columnar, dictionary-encoded copy of the events of each loaded log.
+//
+// Only the columns that repeat a lot are kept (process name, operation,
+// result and path), as codes into a TraceDict, together with the hash of
+// the normalized line, the time of day of the event and the offset of the
+// raw line in the log file, or the event number in a PML capture.
+// Each thread is a list of row numbers. The raw text is read back from the
+// log only when it is displayed, PML events are decoded again for that.
+//
+// With a memory budget the store goes external: events are buffered per
+// thread as fixed-size records and spilled to a <logNo>-<id>.run file
+// whenever the buffers grow past a share of the budget, and sequences are
+// streamed back from those files.
+class TraceStore
+{
+public:
+    enum Column {
+        ProcessColumn,
+        OperationColumn,
+        ResultColumn,
+        PathColumn,
+        ColumnCount
+    };
+
+    // what a thread sequence is made of when comparing threads
+    enum SeqKey {
+        LineSeq,        // the whole normalized line
+        OperationSeq,   // only the operation
+        PathSeq         // only the normalized path
+    };
+
+    TraceStore();
+    ~TraceStore();
+
+    void clear();
+    void clearLog(int logNo);
+    void setBudget(qint64 bytes, const QString &runDir);
+    bool isExternal() const { return budget != NULL; }
+    MemoryBudget *memoryBudget() const { return budget; }
+
+    void beginLog(int logNo, const QString &fname, const QByteArray &header,
+            const QSharedPointer<PmlReader> &pml=QSharedPointer<PmlReader>());
+    bool addEvent(int logNo, const QString &id, qint64 offset, const QList<QByteArray> &fields, quint64 lineHash);
+    bool flush();
+
+    QString logFname(int logNo) const; // where the raw lines are read from
+    bool isPml(int logNo) const;
+    int rowCount(int logNo, const QString &id) const;
+    QByteArray seqHash(int logNo, const QString &id) const;
+    bool rawLine(int logNo, const QString &id, int row, QByteArray &line) const;
+    bool rawLines(int logNo, const QString &id, QList<QByteArray> &lines, int from=0, int to=-1) const;
+    bool writeThread(int logNo, const QString &id, const QString &fname) const;
+
+    bool sequence(int logNo, const QString &id, SeqKey key, QVector<quint64> &seq,
+            int from=0, int to=-1) const;
+
+    // the rows of a thread that fall in a time window, found by binary search
+    bool hasTimes(int logNo) const;
+    bool lineTime(int logNo, const QByteArray &line, quint32 &time) const;
+    bool windowRows(int logNo, const QString &id, const TimeWindow &window, int &from, int &to) const;
+
+    static bool parseTime(const char *data, int len, quint32 &time);
+
+private:
+    // an event as spilled to a run file
+    struct RunRecord {
+        quint64 lineHash;
+        qint64 offset;
+        quint64 operationHash;
+        quint64 pathHash;
+        quint32 time;
+    };
+
+    struct TraceThread {
+        TraceThread(): count(0), hashA(0), hashB(0), lastTime(0) { }
+
+        QVector<quint32> rows;
+        int count;
+
+        // two rolling hashes of the normalized lines, so that the content
+        // hash of a thread can be kept up to date as a log grows
+        quint64 hashA;
+        quint64 hashB;
+
+        QByteArray buffer; // RunRecords not spilled yet
+        quint32 lastTime;
+    };
+
+    struct TraceLog {
+        QString fname;
+        QSharedPointer<PmlReader> pml; // the capture, for a log that is one
+        int fieldCols[ColumnCount]; // CSV field of each column, or -1
+        int timeField;
+
+        QVector<qint64> offsets;
+        QVector<quint32> codes[ColumnCount];
+        QVector<quint64> lineHashes;
+        QVector<quint32> times; // ms since midnight
+
+        QHash<QString, TraceThread> threads;
+    };
+
+    quint32 encode(Column col, const QByteArray &value);
+    quint64 normHash(Column col, const QByteArray &value);
+    QString runFname(int logNo, const QString &id) const;
+    bool readRecords(int logNo, const QString &id, int from, int to, QVector<RunRecord> &records) const;
+    bool threadOffsets(int logNo, const QString &id, int from, int to, QVector<qint64> &offsets) const;
+    bool readLines(int logNo, const QVector<qint64> &offsets, QList<QByteArray> &lines) const;
+    bool rowTime(int logNo, const QString &id, int row, quint32 &time) const;
+    bool firstRowAt(int logNo, const QString &id, quint32 time, int &row) const;
+
+    TraceDict dicts[ColumnCount];
+    QVector<TraceLog> logs;
+    QRegExp numbers;
+
+    MemoryBudget *budget;
+    QString runDir;
+    qint64 bufferLimit;
+    qint64 buffered;
+    int normMemoLimit;
+    QHash<QByteArray, quint64> normMemo[ColumnCount];
+};
+
+#endif // TRACESTORE_H